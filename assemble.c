@@ -6,6 +6,7 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
+#include "fp_fake.h"
 
 static XImage *image = NULL;
 static uint32_t * currentPtr;
@@ -144,17 +145,10 @@ int merge(uint8_t *img, size_t img_sz)
   return 0;
 }
 
-/* Transform binary to image */
+/* Transform binary to image (the low nibble first) */
 void transform (unsigned char *input, unsigned int input_size, uint32_t *output)
 {
-  unsigned int i, j = 0;
-  for (i = 0; i < input_size; i++, j += 2)
-    {
-      unsigned char dl = input[i] << 4;
-      unsigned char dh = input[i] & 0xF0;
-      output[j]   = dl | (dl << 8) | (dl << 16);
-      output[j+1] = dh | (dh << 8) | (dh << 16);
-    }
+  process_transform4_to_32(input, input_size, output, 1);
 }
 
 
@@ -18,8 +18,9 @@ int main()
 
   idev = global_init();
 
-  if (idev == NULL || idev->udev == NULL) {
+  if (idev == NULL) {
     fprintf(stderr, "Cannot open device\n");
+    return 1;
   }
 
   dev = idev->priv;
@@ -28,8 +29,7 @@ int main()
     printf("Contact detected\n");
   }
 
-  if (idev != NULL && idev->udev != NULL)
-    global_exit(idev);
+  global_exit(idev);
 
   return 0;
 }
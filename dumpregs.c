@@ -7,49 +7,6 @@
 #include <libusb.h>
 #include "fp_fake.h"
 
-static libusb_context *fpi_usb_ctx = NULL;
-
-/* Same as global_init but without device initialization */
-static struct fp_img_dev *global_open(void)
-{
-	int ret;
-	struct fp_img_dev *dev;
-
-	ret = libusb_init(&fpi_usb_ctx);
-	if (ret != LIBUSB_SUCCESS) {
-		fprintf(stderr, "libusb_init failed %d\n", ret);
-		goto cantclaim;
-	}
-
-	dev = malloc(sizeof(struct fp_img_dev));
-	if (dev == NULL) {
-		fprintf(stderr, "cannot allocate memory\n");
-		goto cantclaim;
-	}
-
-	dev->udev = libusb_open_device_with_vid_pid(fpi_usb_ctx, 0x1c7a, 0x0603);
-	if (dev->udev == NULL) {
-		fprintf(stderr, "libusb_open_device_with_vid_pid failed\n");
-		free(dev);
-		dev = NULL;
-		goto cantclaim;
-	}
-
-cantclaim:
-	return dev;
-}
-
-static void global_close(struct fp_img_dev * dev)
-{
-	if (dev->udev) {
-		libusb_close(dev->udev);
-		dev->udev = NULL;
-	}
-
-	/* TODO how to test fpi_usb_ctx */
-	libusb_exit(fpi_usb_ctx);
-}
-
 #define WAIT_TIME 10000
 
 static int reg_list[256];
@@ -97,7 +54,7 @@ int main()
 	for (i = 0; i < reg_ind; i++) {
 		reg = reg_list[i];
 		value = 0;
-		if (dev_get_regs(dev->udev, 2, reg, &value)) {
+		if (sync_get_regs(dev->udev, 2, reg, &value)) {
 			fprintf(stderr, "Failed reading reg %x\n", reg);
 			continue;
 		}
@@ -0,0 +1,421 @@
+/*
+ * Emulated EgisTec ES603 sensor, to run the driver and the tools without the
+ * device (for benchmarks and profiling).
+ *
+ * The emulator answers the requests of the driver as the sensor does: it
+ * keeps a register file, models the tuning of DCoffset, DTVRT and VRT/VRB and
+ * synthesizes the frames of a finger swiping over the sensor from a source
+ * fingerprint image.
+ *
+ * Environment:
+ *   ETES603_EMULATE          Source image (binary PGM, dark ridges on white),
+ *                            empty to use a generated pattern
+ *   ETES603_EMULATE_SPEED    Rows moved by the finger between two frames
+ *                            (default: 2.0)
+ *   ETES603_EMULATE_LATENCY  Time to answer a transfer in ms (default: 0)
+ *
+ * The finger is put on the sensor after EMU_FINGER_DELAY tests of the driver
+ * waiting for it: frames read in sensor mode without use_gvv or REG_03 read in
+ * contact mode with the contact detection set up (REG_5B is 0x10, 0x00 while
+ * tuning DTVRT). After each swipe, the next finger waits for a change of the
+ * mode of the sensor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "fp_fake.h"
+
+#define EP_IN              0x81
+#define EP_OUT             0x02
+
+#define CMD_READ_REG       0x01
+#define CMD_WRITE_REG      0x02
+#define CMD_READ_FRAME     0x03
+#define CMD_READ_FP        0x06
+#define CMD_20             0x20
+#define CMD_25             0x25
+#define CMD_60             0x60
+#define CMD_OK             0x01
+
+#define MSG_HDR_SIZE       6
+#define REG_MAX            0x18
+
+#define REG_MODE_CONTROL   0x02
+#define REG_03             0x03
+#define REG_5B             0x5B
+#define REG_VRT            0xE1
+#define REG_DTVRT          0xE3
+#define REG_DCOFFSET       0xE6
+#define REG_MODE_CONTACT   0x31
+#define REG_MODE_SENSOR    0x33
+
+#define FRAME_WIDTH        192
+#define FRAME_HEIGHT       4
+#define FRAMEFP_WIDTH      256
+#define FRAMEFP_HEIGHT     500
+
+#define EMU_FINGER_DELAY   10   /* Tests before a finger is put */
+#define EMU_DC_BLACK       0x20 /* DCoffset giving a black frame */
+#define EMU_DTVRT_CONTACT  0x20 /* DTVRT below which the contact is always on */
+#define EMU_SPEED_DEF      2.0
+#define EMU_IMAGE_WIDTH    256  /* Size of the generated pattern */
+#define EMU_IMAGE_HEIGHT   600
+
+/* Finger on the sensor */
+#define FINGER_WAITING     0    /* Not yet put */
+#define FINGER_SWIPING     1
+#define FINGER_GONE        2    /* Swipe done */
+
+static struct {
+	uint8_t regs[0x100];
+	/* Source image (8 bits gray) */
+	uint8_t *image;
+	unsigned int width;
+	unsigned int height;
+	double speed;
+	unsigned int latency;
+	/* Finger */
+	unsigned int finger;
+	unsigned int tests; /* Tests while the finger is waiting */
+	double pos; /* Row of the image under the first row of the sensor */
+	unsigned int frames; /* Frames sent (seed of the noise) */
+	/* Answer of the last request */
+	uint8_t ans[FRAMEFP_WIDTH * FRAMEFP_HEIGHT / 2];
+	unsigned int ans_size;
+	unsigned int ans_off;
+} emu;
+
+/* Default values of the registers (REG_INFO0-3 identify the sensor). */
+static const uint8_t emu_defaults[][2] = {
+	{ 0x02, 0x30 }, { 0x21, 0x23 }, { 0x22, 0x21 }, { 0x23, 0x20 },
+	{ 0x24, 0x14 }, { 0x25, 0x6A }, { 0x29, 0xC0 }, { 0x2A, 0x50 },
+	{ 0x2B, 0x50 }, { 0x2C, 0x4D }, { 0x2D, 0x03 }, { 0x2E, 0x06 },
+	{ 0x2F, 0x06 }, { 0x30, 0x10 }, { 0x31, 0x02 }, { 0x32, 0x14 },
+	{ 0x33, 0x34 }, { 0x34, 0x01 }, { 0x35, 0x08 }, { 0x36, 0x03 },
+	{ 0x37, 0x21 }, { 0x50, 0x0F }, { 0x70, 0x4A }, { 0x71, 0x44 },
+	{ 0x72, 0x49 }, { 0x73, 0x31 }, { 0xE0, 0x04 }, { 0xE5, 0x13 },
+};
+
+/*
+ * Load a binary PGM image (P5, 8 bits).
+ */
+static int emu_load_pgm(const char *path)
+{
+	FILE *f;
+	unsigned int w, h, maxval;
+	int c;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		fp_err("cannot open %s (errno=%d)", path, errno);
+		return -1;
+	}
+	if (fgetc(f) != 'P' || fgetc(f) != '5')
+		goto err_format;
+	/* Skip the comments between the values of the header. */
+	while ((c = fgetc(f)) == '#' || c == ' ' || c == '\n' || c == '\r'
+	       || c == '\t') {
+		if (c == '#')
+			while ((c = fgetc(f)) != '\n' && c != EOF)
+				;
+	}
+	ungetc(c, f);
+	if (fscanf(f, "%u %u %u", &w, &h, &maxval) != 3 || maxval > 255
+	    || w == 0 || h == 0)
+		goto err_format;
+	fgetc(f);
+	if ((emu.image = malloc(w * h)) == NULL)
+		goto err_close;
+	if (fread(emu.image, 1, w * h, f) != w * h) {
+		free(emu.image);
+		emu.image = NULL;
+		goto err_format;
+	}
+	fclose(f);
+	emu.width = w;
+	emu.height = h;
+	return 0;
+
+err_format:
+	fp_err("%s is not a binary PGM image", path);
+err_close:
+	fclose(f);
+	return -1;
+}
+
+/*
+ * Generate ridges as a source image.
+ */
+static int emu_generate(void)
+{
+	unsigned int x, y;
+	int dx, dy;
+
+	emu.width = EMU_IMAGE_WIDTH;
+	emu.height = EMU_IMAGE_HEIGHT;
+	if ((emu.image = malloc(emu.width * emu.height)) == NULL)
+		return -1;
+	/* Concentric ridges with a period of 8 pixels. */
+	for (y = 0; y < emu.height; y++) {
+		for (x = 0; x < emu.width; x++) {
+			dx = x - emu.width / 2;
+			dy = y - emu.height / 2;
+			emu.image[y * emu.width + x] =
+				((dx * dx + dy * dy) / 40) % 8 < 4 ? 0x30 : 0xF0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Open the emulated sensor (see the environment above).
+ */
+int emu_open(void)
+{
+	const char *path, *s;
+	unsigned int i;
+
+	memset(&emu, 0, sizeof(emu));
+	for (i = 0; i < sizeof(emu_defaults) / sizeof(emu_defaults[0]); i++)
+		emu.regs[emu_defaults[i][0]] = emu_defaults[i][1];
+	emu.speed = EMU_SPEED_DEF;
+	if ((s = getenv("ETES603_EMULATE_SPEED")) != NULL)
+		emu.speed = strtod(s, NULL);
+	if (emu.speed <= 0.0 || emu.speed > FRAME_HEIGHT) {
+		fp_warn("ETES603_EMULATE_SPEED must be between 0 and %d",
+			FRAME_HEIGHT);
+		emu.speed = EMU_SPEED_DEF;
+	}
+	if ((s = getenv("ETES603_EMULATE_LATENCY")) != NULL)
+		emu.latency = strtoul(s, NULL, 10);
+
+	path = getenv("ETES603_EMULATE");
+	if (path == NULL || path[0] == '\0')
+		return emu_generate();
+	return emu_load_pgm(path);
+}
+
+/*
+ * Time to answer a transfer in ms.
+ */
+unsigned int emu_latency(void)
+{
+	return emu.latency;
+}
+
+/*
+ * Pseudo-random value in [0, 1023] of a pixel of a frame.
+ */
+static unsigned int emu_noise(unsigned int x, unsigned int y)
+{
+	uint32_t h = x * 0x9E3779B1U ^ y * 0x85EBCA77U ^ emu.frames * 0xC2B2AE3DU;
+
+	h ^= h >> 15;
+	h *= 0x2C1B3C6DU;
+	h ^= h >> 12;
+	return h & 0x3FF;
+}
+
+/*
+ * Value of the pixel (x, y) of the image, as seen by the sensor (white on
+ * black), or -1 outside of the image.
+ */
+static int emu_pixel(int x, int y)
+{
+	if (x < 0 || y < 0 || x >= (int)emu.width || y >= (int)emu.height)
+		return -1;
+	return (255 - emu.image[y * emu.width + x]) >> 4;
+}
+
+/*
+ * Synthesize a frame of 'width' x 'height' pixels. Without finger, the
+ * brightness of the frame depends on DCoffset and its contrast on VRT.
+ */
+static void emu_frame(uint8_t *out, unsigned int width, unsigned int height,
+	uint8_t vrt)
+{
+	int level = EMU_DC_BLACK - emu.regs[REG_DCOFFSET];
+	int amp = vrt / 8;
+	int x0 = ((int)emu.width - (int)width) / 2;
+	int y0 = (int)emu.pos;
+	unsigned int x, y;
+	int p[2], k;
+
+	if (level < 0)
+		level = 0;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x += 2) {
+			for (k = 0; k < 2; k++) {
+				p[k] = -1;
+				if (emu.finger == FINGER_SWIPING)
+					p[k] = emu_pixel(x0 + x + k, y0 + y);
+				/* Black above the DCoffset threshold. */
+				if (p[k] < 0 && level == 0)
+					p[k] = 0;
+				else if (p[k] < 0)
+					p[k] = level + (int)(emu_noise(x + k, y)
+						* (2 * amp + 1) / 1024) - amp;
+				if (p[k] < 0)
+					p[k] = 0;
+				if (p[k] > 15)
+					p[k] = 15;
+			}
+			/* The first pixel is in the high nibble. */
+			out[(y * width + x) / 2] = (p[0] << 4) | p[1];
+		}
+	}
+	emu.frames++;
+}
+
+/*
+ * A test for the finger: the finger is put after EMU_FINGER_DELAY tests.
+ */
+static void emu_finger_test(void)
+{
+	if (emu.finger == FINGER_WAITING && ++emu.tests >= EMU_FINGER_DELAY) {
+		emu.finger = FINGER_SWIPING;
+		emu.pos = 0.0;
+	}
+}
+
+/*
+ * Move the finger after a frame; it leaves at the end of the image.
+ */
+static void emu_finger_move(void)
+{
+	if (emu.finger != FINGER_SWIPING)
+		return;
+	emu.pos += emu.speed;
+	if (emu.pos + FRAME_HEIGHT > emu.height)
+		emu.finger = FINGER_GONE;
+}
+
+/*
+ * Process a request and prepare its answer.
+ */
+static int emu_request(const uint8_t *req, int size)
+{
+	uint8_t *ans = emu.ans;
+	unsigned int i, n, reg, contact;
+
+	if (size < MSG_HDR_SIZE || memcmp(req, "EGIS\x09", 5)) {
+		fp_err("emulator: wrong request header");
+		return -EIO;
+	}
+	memcpy(ans, "SIGE\x0A", 5);
+	ans[5] = CMD_OK;
+	emu.ans_size = MSG_HDR_SIZE;
+	emu.ans_off = 0;
+
+	switch (req[5]) {
+	case CMD_READ_REG:
+		n = req[6];
+		if (n > REG_MAX || size < MSG_HDR_SIZE + 1 + (int)n)
+			return -EIO;
+		for (i = 0; i < n; i++) {
+			reg = req[7 + i];
+			if (reg == REG_03) {
+				/* Bit 4 is the contact, always on when DTVRT
+				 * is too low. */
+				if (emu.regs[REG_MODE_CONTROL] == REG_MODE_CONTACT
+				    && emu.regs[REG_5B] == 0x10)
+					emu_finger_test();
+				contact = emu.finger == FINGER_SWIPING
+					|| emu.regs[REG_DTVRT] < EMU_DTVRT_CONTACT;
+				emu.regs[REG_03] = contact ? 0x93 : 0x83;
+			}
+			ans[6 + i] = emu.regs[reg];
+		}
+		emu.ans_size += n;
+		break;
+
+	case CMD_WRITE_REG:
+		n = req[6];
+		if (n > REG_MAX || size < MSG_HDR_SIZE + 1 + 2 * (int)n)
+			return -EIO;
+		for (i = 0; i < n; i++) {
+			reg = req[7 + 2 * i];
+			emu.regs[reg] = req[8 + 2 * i];
+			/* A new session starts with a mode change. */
+			if (reg == REG_MODE_CONTROL
+			    && emu.finger == FINGER_GONE) {
+				emu.finger = FINGER_WAITING;
+				emu.tests = 0;
+			}
+		}
+		break;
+
+	case CMD_READ_FRAME:
+		if (size < MSG_HDR_SIZE + 6)
+			return -EIO;
+		if (emu.regs[REG_MODE_CONTROL] == REG_MODE_SENSOR && !req[8])
+			emu_finger_test();
+		/* The frame has 'length' * 2 bytes of 2 pixels. use_gvv
+		 * selects gain/vrt/vrb of the request. */
+		emu_frame(ans, req[7] * 4 / FRAME_HEIGHT, FRAME_HEIGHT,
+			  req[8] ? req[10] : emu.regs[REG_VRT]);
+		emu.ans_size = req[7] * 2;
+		emu_finger_move();
+		break;
+
+	case CMD_READ_FP:
+		emu_frame(ans, FRAMEFP_WIDTH, FRAMEFP_HEIGHT, emu.regs[REG_VRT]);
+		emu.ans_size = FRAMEFP_WIDTH * FRAMEFP_HEIGHT / 2;
+		if (emu.finger == FINGER_SWIPING)
+			emu.finger = FINGER_GONE;
+		break;
+
+	case CMD_20:
+		/* Same answer as the sensor. */
+		ans[5] = 0x05;
+		ans[6] = ans[7] = 0x00;
+		emu.ans_size += 2;
+		break;
+
+	case CMD_25:
+		ans[6] = 0x00;
+		emu.ans_size++;
+		break;
+
+	case CMD_60:
+		/* LEDs: 0x01 reads, 0x02 writes. */
+		if (size > MSG_HDR_SIZE + 1 && req[6] == 0x02)
+			emu.regs[0x00] = req[7];
+		ans[6] = emu.regs[0x00];
+		emu.ans_size++;
+		break;
+
+	default:
+		fp_err("emulator: unknown command %02X", req[5]);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Transfer with the emulated sensor: a request on EP_OUT, then its answer is
+ * read on EP_IN (in one or several reads). Returns 0 or a negative error.
+ */
+int emu_transfer(unsigned char ep, uint8_t *data, int size, int *actual_length)
+{
+	unsigned int len;
+
+	*actual_length = 0;
+	if (ep == EP_OUT) {
+		if (emu_request(data, size))
+			return -EIO;
+		*actual_length = size;
+		return 0;
+	}
+	if (emu.ans_off >= emu.ans_size)
+		return -ETIMEDOUT;
+	len = emu.ans_size - emu.ans_off;
+	if (len > (unsigned int)size)
+		len = size;
+	memcpy(data, emu.ans + emu.ans_off, len);
+	emu.ans_off += len;
+	*actual_length = len;
+	return 0;
+}
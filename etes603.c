@@ -34,6 +34,29 @@
  *
  * To log communication with the sensor, just define DEBUG_TRANSFER.
  * #define DEBUG_TRANSFER
+ *
+ * To print the statistics of the requests (latency, bytes, errors) when the
+ * sensor is closed, define ETES603_STATS in the environment. The gui tool
+ * prints and resets them with its Stats and RstStats buttons.
+ *
+ * To record a binary trace of the transfers, set ETES603_TRACE to the path of
+ * the trace. To replay a recorded trace instead of using the sensor, set
+ * ETES603_REPLAY to its path (see transport_get). The tools can also use an
+ * emulated sensor, see emulator.c.
+ *
+ * The frames are processed with SIMD kernels when the CPU has them, set
+ * ETES603_SIMD=0 to use the scalar versions (see kernels_init).
+ *
+ * To merge the frames of the assembled frames mode in a worker thread instead
+ * of the USB callbacks, set ETES603_WORKER=1 (see capture_worker). To align
+ * them once the finger has left instead of frame by frame, set
+ * ETES603_DEFER=1 (see capture_assemble).
+ *
+ * The assembled frames mode keeps one frame request in flight. Set
+ * ETES603_DEPTH (up to CAPTURE_DEPTH_MAX) to pipeline more of them (see
+ * capture_submit): the images are the same, only a few more frames are read
+ * after the finger leaves. A trace is replayed only with the depth it was
+ * recorded with.
  */
 
 /* TODO LIST
@@ -47,11 +70,25 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <assert.h>
-#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libusb.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define KERNELS_X86
+# include <immintrin.h>
+#elif defined(__ARM_NEON)
+# define KERNELS_NEON
+# include <arm_neon.h>
+#endif
+
 #define FP_COMPONENT "etes603"
 #include <fp_internal.h>
 #include <drivers/driver_ids.h>
@@ -164,7 +201,26 @@
 
 /* Contact sensor parameters */
 #define CS_DETECT_TIMEOUT  5000 /* Waiting time to detect contact (ms) */
-#define CS_DETECT_DELAY    5    /* Delay between each test (ms) */
+#define CS_POLL_MIN        5    /* Delay between each test at first (ms) */
+#define CS_POLL_MAX        50   /* Maximum delay between each test (ms) */
+#define CS_POLL_FAST       1000 /* Time before increasing the delay (ms) */
+
+/* Pipelined capture parameters (assembled frames mode) */
+#define CAPTURE_DEPTH_MAX  8    /* Maximum number of frame requests in flight */
+#define CAPTURE_DEPTH_DEF  1    /* Default value (ETES603_DEPTH to change it), not checked with more on the sensor yet */
+#define BRAW_CHUNK         4096 /* Growth of the raw buffer (a page) */
+#define RING_SIZE          16   /* Frames queued for the worker (power of 2) */
+#define RING_RETRY         1    /* Delay before queuing again a frame when the ring is full (ms) */
+
+/* Statistics of the requests */
+#define STATS_CMD_MAX      7    /* Number of commands measured (see stats_index) */
+#define STATS_HIST_SIZE    16   /* Latency buckets: < 128 us, then doubling */
+
+/* Calibration cache (ETES603_CALIBRATION to change the file, empty to
+ * disable it), one per sensor (see calibration_path) */
+#define CALIBRATION_FILE   "/var/cache/etes603.cal"
+#define CALIBRATION_PORTS  7    /* Maximum depth of the USB port path */
+#define CALIBRATION_MAGIC  "etes603-calibration-1"
 
 /* This structure must be packed because it is a the raw message sent. */
 struct egis_msg {
@@ -205,6 +261,80 @@ struct egis_msg {
 } __attribute__((packed));
 
 
+/* Statistics of the requests of one command. */
+struct cmd_stats {
+	unsigned long requests; /* Requests completed or failed */
+	unsigned long errors; /* Failed requests (timeouts included) */
+	unsigned long timeouts; /* Requests failed with a timeout */
+	unsigned long retries; /* Additional reads of a fragmented answer */
+	unsigned long long bytes_out;
+	unsigned long long bytes_in;
+	unsigned long long time_total; /* Sum of the latencies (us) */
+	unsigned long time_max; /* Highest latency (us) */
+	unsigned long hist[STATS_HIST_SIZE]; /* Latencies (see stats_end) */
+};
+
+/* Request being measured, from its submission to the end of its answer. */
+struct stats_req {
+	uint8_t cmd;
+	int status; /* First error of its transfers */
+	unsigned int reads; /* Number of reads of the answer */
+	unsigned int bytes_out;
+	unsigned int bytes_in;
+	struct timespec start;
+};
+
+/* Consumer of the lines of the assembled image while it is captured (see
+ * dev_set_rows_cb): 'rows' holds 'n' lines of FRAME_WIDTH pixels of 4 bits.
+ * The end of the image is signaled by n == 0, with 'status' 0 if the image
+ * is sent to libfprint, -ECANCELED if the capture is stopped by a
+ * deactivation, or the error of the session. 'status' is 0 for the lines. */
+typedef void (*dev_rows_fn)(void *data, const uint8_t *rows, unsigned int n,
+	int status);
+
+/* Frame request of the pipelined capture: the CMD_READ_FRAME request and the
+ * reading of the answer are submitted together. */
+struct frame_slot {
+	struct fp_img_dev *idev;
+	struct libusb_transfer *req; /* CMD_READ_FRAME on EP_OUT */
+	struct libusb_transfer *ans; /* Frame on EP_IN */
+	unsigned int pending; /* Number of transfers not completed */
+	unsigned int busy; /* Waiting for its frame to be processed */
+	struct egis_msg msg;
+	struct stats_req sreq;
+	uint8_t frame[FRAME_SIZE];
+};
+
+/* Frame with its statistics, computed once when it is received (see
+ * process_frame_describe). */
+struct frame_desc {
+	uint8_t *raw; /* FRAME_SIZE bytes */
+	unsigned int brightness; /* Sum of the pixels */
+	/* Pixels by value in the center of the lines, high nibbles only. Only
+	 * the tuning uses it, see process_frame_histogram. */
+	unsigned int hist[16];
+	unsigned int has_hist;
+};
+
+/* Frames received by the USB callbacks (the only producer) for the assembly
+ * worker (the only consumer). Each side writes its index only, the other side
+ * reads it with acquire semantics. */
+struct frame_ring {
+	unsigned int head; /* Next frame to write */
+	unsigned int tail; /* Next frame to read */
+	uint8_t frames[RING_SIZE][FRAME_SIZE];
+};
+
+/* Values of the tuning in progress (see open_step). */
+struct tune_state {
+	uint8_t gain, min, max, dcoffset; /* DCoffset and gain */
+	uint8_t dtvrt, dcoffset_ct; /* DTVRT */
+	uint8_t reg_e5, reg_50, reg_51, reg_59, reg_5a, reg_5b; /* Saved */
+	uint8_t vrt, vrb, reg_dc; /* VRT and VRB */
+	unsigned int check; /* The values of the cache are checked */
+	unsigned int check_failed; /* They do not match the sensor */
+};
+
 /* Structure to keep information between asynchronous functions. */
 struct etes603_dev {
 	libusb_device_handle *udev;
@@ -216,21 +346,266 @@ struct etes603_dev {
 	 * DCOffset. */
 	uint8_t dcoffset_ct;
 	uint8_t dtvrt;
-	/* TODO can probably keep registers value, particularly control_mode */
+	uint8_t info[4]; /* REG_INFO0-3 (identify the calibration cache) */
+	/* Shadow copy of the registers (see reg_shadowed) */
+	uint8_t regs[0x100];
+	uint8_t regs_known[0x100 / 8]; /* Bitmap of known values */
+	/* Register writes not sent yet (see dev_queue_regs) */
+	struct egis_msg wregs;
+
+	/* Request sequence (see seq_run) */
+	int (*seq_step)(struct etes603_dev *dev);
+	void (*seq_done)(struct fp_img_dev *idev, int status);
+	unsigned int step;
+	unsigned int op_size; /* Size of the request in msg */
+	unsigned int op_frame; /* The answer is a frame (else a message) */
+	unsigned int delay; /* Time to wait before the next step (ms) */
+	struct fpi_timeout *timer; /* Pending wait */
+	int open_status; /* Error of a failed open (see open_reset_done) */
+	struct tune_state tune;
+	/* Contact detection */
+	struct timespec poll_start;
 
 	/* Asynchronous fields */
 	unsigned int deactivating; /* TODO could be merge with state? */
 	unsigned int state;
 	unsigned int mode; /* FingerPrint mode (0) or merging frames (1) */
-	uint8_t *braw; /* Pointer to raw buffer */
-	uint8_t *braw_cur; /* Current position in the raw buffer */
+	unsigned int detect; /* Finger detection with frames (0) or contact (1) */
+	unsigned int defer; /* Frames are aligned at the end of the swipe */
+	uint8_t *braw; /* Pointer to raw buffer (see braw_grow) */
+	uint8_t *braw_cur; /* Current position in the raw buffer (end of the
+			    * frames if defer) */
 	uint8_t *braw_end; /* End of the raw buffer */
+	int new_line; /* New lines of the last frame (see process_frame_predict) */
+	dev_rows_fn rows_cb; /* Consumer of the lines (see dev_set_rows_cb) */
+	void *rows_data;
+	size_t rows_done; /* Bytes of braw given to rows_cb */
+
+	/* Transfers and buffers of the asynchronous functions are allocated
+	 * once when the sensor is opened and reused for each activation. */
+	struct libusb_transfer *req; /* Request on EP_OUT */
+	struct libusb_transfer *ans; /* Answer on EP_IN */
+	struct egis_msg msg; /* Request buffer */
+	uint8_t *buf; /* Answer buffer (FRAME_SIZE bytes) */
+	struct stats_req sreq; /* Request in flight */
+
+	/* Pipelined capture */
+	unsigned int depth; /* Number of frame requests kept in flight */
+	unsigned int inflight; /* Number of capture transfers not completed */
+	unsigned int seq; /* Sequence number of the next frame to process */
+	int capture_err; /* Error during capture */
+	struct frame_slot slots[CAPTURE_DEPTH_MAX];
+
+	/* Assembly worker (see capture_worker) */
+	unsigned int worker; /* Use a worker (ETES603_WORKER) */
+	unsigned int worker_run; /* The worker of this capture is started */
+	pthread_t worker_thread;
+	sem_t worker_sem; /* Posted for each queued frame and to stop */
+	unsigned int worker_stop; /* The worker must exit */
+	unsigned int worker_end; /* The worker has merged the last frame */
+	struct frame_ring ring;
+	struct fpi_timeout *ring_timer; /* Waiting for room in the ring */
+	unsigned int ring_full; /* Frames which waited for room */
+
+	/* Statistics of the requests by command (see dev_get_stats) */
+	struct cmd_stats stats[STATS_CMD_MAX];
 };
 
 /* Forward declarations */
-static uint8_t *process_frame(uint8_t *dst, uint8_t *src);
+static uint8_t *process_frame_predict(uint8_t *dst,
+	const struct frame_desc *src, int *new_line);
+static uint8_t *process_frame_merge(uint8_t *dst, uint8_t *src,
+	unsigned int new_line);
+static int process_frames_align(uint8_t *frames, unsigned int n,
+	uint8_t *new_lines);
+static void process_frame_describe(struct frame_desc *fd, uint8_t *raw);
+static void process_frame_histogram(struct frame_desc *fd);
 static int process_frame_empty(uint8_t *f, size_t s, int mode);
+static int process_frame_desc_empty(const struct frame_desc *fd, int mode);
 static int contact_detect(struct etes603_dev *dev);
+static void kernels_init(void);
+
+/*
+ * Get the time from the monotonic clock (not affected by changes of the
+ * system time).
+ */
+static int time_get(struct timespec *ts)
+{
+	if (clock_gettime(CLOCK_MONOTONIC, ts)) {
+		fp_err("clock_gettime failed with %d", errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Get the time elapsed since 'start' in ms.
+ */
+static int time_elapsed(const struct timespec *start, unsigned int *elapsed)
+{
+	struct timespec now;
+
+	if (time_get(&now))
+		return -1;
+	*elapsed = (now.tv_sec - start->tv_sec) * 1000
+		 + (now.tv_nsec - start->tv_nsec) / 1000000;
+	return 0;
+}
+
+/*
+ * Return the index of the command in the statistics or -1 if it is not
+ * measured.
+ */
+static int stats_index(uint8_t cmd)
+{
+	switch (cmd) {
+	case CMD_READ_REG:
+		return 0;
+	case CMD_WRITE_REG:
+		return 1;
+	case CMD_READ_FRAME:
+		return 2;
+	case CMD_READ_FP:
+		return 3;
+	case CMD_20:
+		return 4;
+	case CMD_25:
+		return 5;
+	case CMD_60:
+		return 6;
+	}
+	return -1;
+}
+
+/*
+ * Start measuring a request of the command 'cmd'.
+ */
+static void stats_begin(struct stats_req *req, uint8_t cmd)
+{
+	memset(req, 0, sizeof(*req));
+	req->cmd = cmd;
+	time_get(&req->start);
+}
+
+/*
+ * Account a transfer of the request, 'status' is 0 or the error of the
+ * transfer (-ETIMEDOUT for a timeout).
+ */
+static void stats_transfer(struct stats_req *req, unsigned char ep, int len,
+	int status)
+{
+	if (status) {
+		if (req->status == 0)
+			req->status = status;
+		return;
+	}
+	if (ep == EP_OUT) {
+		req->bytes_out += len;
+	} else {
+		req->bytes_in += len;
+		req->reads++;
+	}
+}
+
+/*
+ * End of the request: add it to the statistics of its command ('stats' may be
+ * NULL when the sensor is used without being opened).
+ * The latency histogram has buckets of power of 2: bucket 0 is below 128 us,
+ * bucket i from 64 << i to 128 << i us and the last one is above.
+ */
+static void stats_end(struct cmd_stats *stats, struct stats_req *req)
+{
+	struct cmd_stats *cs;
+	struct timespec now;
+	unsigned long us, t;
+	int i;
+
+	if (stats == NULL || (i = stats_index(req->cmd)) < 0)
+		return;
+	cs = &stats[i];
+	cs->requests++;
+	cs->bytes_out += req->bytes_out;
+	cs->bytes_in += req->bytes_in;
+	if (req->reads > 1)
+		cs->retries += req->reads - 1;
+	if (req->status) {
+		cs->errors++;
+		if (req->status == -ETIMEDOUT)
+			cs->timeouts++;
+		return;
+	}
+	/* Only the latencies of successful requests are kept. */
+	if (time_get(&now))
+		return;
+	us = (now.tv_sec - req->start.tv_sec) * 1000000
+	   + (now.tv_nsec - req->start.tv_nsec) / 1000;
+	cs->time_total += us;
+	if (us > cs->time_max)
+		cs->time_max = us;
+	for (i = 0, t = us >> 7; t != 0 && i < STATS_HIST_SIZE - 1; t >>= 1)
+		i++;
+	cs->hist[i]++;
+}
+
+/*
+ * Return the statistics of the requests of the command 'cmd' (CMD_READ_REG,
+ * CMD_WRITE_REG, ...) since the sensor was opened or NULL if the command is
+ * not measured.
+ */
+static const struct cmd_stats *dev_get_stats(struct etes603_dev *dev,
+	uint8_t cmd)
+{
+	int i = stats_index(cmd);
+
+	return i < 0 ? NULL : &dev->stats[i];
+}
+
+/*
+ * Reset the statistics of all commands.
+ */
+__attribute__((used))
+static void dev_reset_stats(struct etes603_dev *dev)
+{
+	memset(dev->stats, 0, sizeof(dev->stats));
+}
+
+/*
+ * Write the statistics of the commands used since the sensor was opened or
+ * dev_reset_stats was called. They are written to stderr when the sensor is
+ * closed if ETES603_STATS is defined, and on demand by the gui tool.
+ */
+__attribute__((used))
+static void dev_dump_stats(struct etes603_dev *dev, FILE *f)
+{
+	static const uint8_t cmds[STATS_CMD_MAX] = { CMD_READ_REG,
+		CMD_WRITE_REG, CMD_READ_FRAME, CMD_READ_FP, CMD_20, CMD_25,
+		CMD_60 };
+	const struct cmd_stats *cs;
+	unsigned int i, j;
+
+	fprintf(f, "cmd  requests errors timeouts retries bytes_out bytes_in "
+		"avg_us max_us\n");
+	for (i = 0; i < STATS_CMD_MAX; i++) {
+		cs = dev_get_stats(dev, cmds[i]);
+		if (cs->requests == 0)
+			continue;
+		fprintf(f, "0x%02X %8lu %6lu %8lu %7lu %9llu %8llu %6llu %6lu\n",
+			cmds[i], cs->requests, cs->errors, cs->timeouts,
+			cs->retries, cs->bytes_out, cs->bytes_in,
+			cs->requests > cs->errors ? cs->time_total /
+			(cs->requests - cs->errors) : 0, cs->time_max);
+		fprintf(f, "    latency:");
+		for (j = 0; j < STATS_HIST_SIZE; j++) {
+			if (cs->hist[j] == 0)
+				continue;
+			if (j == STATS_HIST_SIZE - 1)
+				fprintf(f, " >=%lu:%lu", 64UL << j, cs->hist[j]);
+			else
+				fprintf(f, " <%lu:%lu", 128UL << j, cs->hist[j]);
+		}
+		fprintf(f, "\n");
+	}
+}
 
 #ifdef DEBUG_TRANSFER
 static void debug_output(unsigned char ep, uint8_t *data, size_t size) {
@@ -260,28 +635,476 @@ static void debug_output(unsigned char ep, uint8_t *data, size_t size) {
 	fwrite("\n", 1, 1, fdebug);
 }
 #else
-# define debug_output(...)
+# define debug_output(...) do { } while (0)
 #endif
 
 /*
- * Transfer (in/out) egis command to the device using synchronous libusb.
+ * Trace and replay
+ *
+ * A trace is a trace_file header followed by one record per transfer: a
+ * trace_rec header and the data transferred, padded to 8 bytes so that the
+ * records of a mapped trace can be read in place. Values are in the byte
+ * order of the host.
+ */
+
+#define TRACE_MAGIC        "ES603TRC"
+#define TRACE_VERSION      1
+#define TRACE_BUF_SIZE     (256 * 1024) /* Buffer of the trace writer */
+#define TRACE_ALIGN(n)     (((n) + 7) & ~7U)
+
+#define TRACE_OK           0    /* Status of a record */
+#define TRACE_TIMEOUT      1
+#define TRACE_ERROR        2
+
+#define LOCAL_QUEUE_MAX    32   /* Maximum number of transfers in flight */
+
+struct trace_file {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct trace_rec {
+	uint64_t time; /* End of the transfer since the start of the trace (ns) */
+	uint32_t size; /* Bytes transferred */
+	uint8_t ep;
+	uint8_t status;
+	uint16_t reserved;
+};
+
+/* Trace being recorded, (void *)~0 if disabled */
+static FILE *trace_out = NULL;
+static struct timespec trace_start;
+
+/* Trace being replayed */
+static struct {
+	uint8_t *map;
+	size_t size;
+	size_t next_out; /* Offset of the next record to look at on EP_OUT */
+	size_t next_in; /* Same on EP_IN */
+} replay;
+
+#ifdef ETES603_EMULATOR
+/* Emulated sensor (emulator.c, only linked in the tools) */
+int emu_open(void);
+unsigned int emu_latency(void);
+int emu_transfer(unsigned char ep, uint8_t *data, int size,
+	int *actual_length);
+#endif
+
+/*
+ * Transport of the transfers: the sensor through libusb, or transfers answered
+ * locally from a replayed trace or an emulator (see transport_get). Functions
+ * return a libusb error code. Asynchronous transfers complete from the event
+ * loop, as with libusb.
+ */
+struct transport {
+	const char *name;
+	int (*claim)(libusb_device_handle *udev);
+	void (*release)(libusb_device_handle *udev);
+	/* Synchronous bulk transfer */
+	int (*bulk)(libusb_device_handle *udev, unsigned char ep,
+		unsigned char *data, int size, int *actual_length);
+	int (*submit)(struct libusb_transfer *transfer);
+	/* Handle the completions, waiting at most 'tv' (tools only, libfprint
+	 * handles the events of the driver) */
+	int (*poll)(struct timeval *tv);
+};
+
+/* Transport in use, chosen at the first transfer */
+static const struct transport *transport = NULL;
+
+/* Transfers answered locally */
+static struct {
+	/* Answer a transfer, returns 0 or an error (-ETIMEDOUT on timeout) */
+	int (*answer)(unsigned char ep, uint8_t *data, int size,
+		int *actual_length);
+	unsigned int latency; /* Time taken by each transfer (ms) */
+	/* Asynchronous transfers waiting for their callback */
+	struct libusb_transfer *queue[LOCAL_QUEUE_MAX];
+	unsigned int head;
+	unsigned int count;
+} local;
+
+/*
+ * Open the trace given by ETES603_TRACE, if any.
  */
-static int sync_transfer(libusb_device_handle *udev, unsigned char ep,
-		struct egis_msg *msg, unsigned int size)
+static void trace_open(void)
 {
-	int ret, actual_length;
-	unsigned char *data = (unsigned char *)msg;
+	struct trace_file hdr;
+	const char *path;
+
+	trace_out = (void *)~0;
+	if ((path = getenv("ETES603_TRACE")) == NULL || path[0] == '\0')
+		return;
+	if (time_get(&trace_start))
+		return;
+	if ((trace_out = fopen(path, "wb")) == NULL) {
+		fp_warn("cannot open trace %s (errno=%d)", path, errno);
+		trace_out = (void *)~0;
+		return;
+	}
+	/* Records are written in a large buffer, the trace is written when
+	 * it is full and when the sensor is closed. */
+	setvbuf(trace_out, NULL, _IOFBF, TRACE_BUF_SIZE);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	fwrite(&hdr, sizeof(hdr), 1, trace_out);
+}
+
+/*
+ * Record a transfer of 'size' bytes, 'status' is 0 or the error of the
+ * transfer (-ETIMEDOUT for a timeout).
+ */
+static void trace_record(unsigned char ep, const uint8_t *data,
+	unsigned int size, int status)
+{
+	static const uint8_t pad[8];
+	struct trace_rec rec;
+	struct timespec now;
+
+	if (trace_out == NULL)
+		trace_open();
+	if (trace_out == (void *)~0 || time_get(&now))
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.time = (uint64_t)(now.tv_sec - trace_start.tv_sec) * 1000000000
+		 + now.tv_nsec - trace_start.tv_nsec;
+	rec.size = size;
+	rec.ep = ep;
+	rec.status = status == 0 ? TRACE_OK
+		   : status == -ETIMEDOUT ? TRACE_TIMEOUT : TRACE_ERROR;
+	fwrite(&rec, sizeof(rec), 1, trace_out);
+	fwrite(data, 1, size, trace_out);
+	fwrite(pad, 1, TRACE_ALIGN(size) - size, trace_out);
+}
+
+/*
+ * Write the buffered records of the trace.
+ */
+static void trace_flush(void)
+{
+	if (trace_out != NULL && trace_out != (void *)~0)
+		fflush(trace_out);
+}
+
+/*
+ * Map the trace 'path' to replay it. Returns true on success.
+ */
+static int replay_open(const char *path)
+{
+	const struct trace_file *hdr;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fp_err("cannot open trace %s (errno=%d)", path, errno);
+		return 0;
+	}
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		fp_err("cannot read trace %s", path);
+		close(fd);
+		return 0;
+	}
+	replay.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (replay.map == MAP_FAILED) {
+		fp_err("cannot map trace %s (errno=%d)", path, errno);
+		return 0;
+	}
+	hdr = (const struct trace_file *)replay.map;
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic))
+	    || hdr->version != TRACE_VERSION) {
+		fp_err("%s is not a trace", path);
+		munmap(replay.map, st.st_size);
+		return 0;
+	}
+	replay.size = st.st_size;
+	replay.next_out = replay.next_in = sizeof(*hdr);
+	fp_dbg("replaying trace %s", path);
+	return 1;
+}
+
+/*
+ * Answer a transfer from the next record of its endpoint. Each endpoint is
+ * read in order, so the order of completion of the pipelined requests does
+ * not matter. Returns 0 or the error of the record.
+ */
+static int replay_transfer(unsigned char ep, uint8_t *data, int size,
+	int *actual_length)
+{
+	size_t *next = (ep == EP_OUT) ? &replay.next_out : &replay.next_in;
+	const struct trace_rec *rec = NULL;
+	const uint8_t *payload;
+	int len;
+
+	while (*next + sizeof(*rec) <= replay.size) {
+		rec = (const struct trace_rec *)(replay.map + *next);
+		if (sizeof(*rec) + rec->size > replay.size - *next) {
+			rec = NULL;
+			break;
+		}
+		*next += sizeof(*rec) + TRACE_ALIGN(rec->size);
+		if (rec->ep == ep)
+			break;
+		rec = NULL;
+	}
+	*actual_length = 0;
+	if (rec == NULL) {
+		fp_err("end of the replayed trace");
+		return -EIO;
+	}
+
+	payload = (const uint8_t *)(rec + 1);
+	len = (int)rec->size < size ? (int)rec->size : size;
+	if (ep == EP_IN) {
+		memcpy(data, payload, len);
+	} else if ((int)rec->size != size || memcmp(data, payload, len)) {
+		fp_warn("request differs from the replayed trace");
+	}
+	*actual_length = len;
+
+	if (rec->status == TRACE_OK)
+		return 0;
+	return rec->status == TRACE_TIMEOUT ? -ETIMEDOUT : -EIO;
+}
 
+/*
+ * Transport on the sensor.
+ */
+static int usb_claim(libusb_device_handle *udev)
+{
+	return libusb_claim_interface(udev, 0);
+}
+
+static void usb_release(libusb_device_handle *udev)
+{
+	libusb_release_interface(udev, 0);
+}
+
+static int usb_bulk(libusb_device_handle *udev, unsigned char ep,
+	unsigned char *data, int size, int *actual_length)
+{
 	assert(udev != NULL);
+	return libusb_bulk_transfer(udev, ep, data, size, actual_length,
+				    BULK_TIMEOUT);
+}
+
+static int usb_poll(struct timeval *tv)
+{
+	return libusb_handle_events_timeout(fpi_usb_ctx, tv);
+}
+
+static const struct transport transport_usb = {
+	.name = "usb",
+	.claim = usb_claim,
+	.release = usb_release,
+	.bulk = usb_bulk,
+	.submit = libusb_submit_transfer,
+	.poll = usb_poll,
+};
+
+/*
+ * Transport answering the transfers locally with local.answer. There is no
+ * interface to claim.
+ */
+static int local_claim(libusb_device_handle *udev)
+{
+	(void)udev;
+	return LIBUSB_SUCCESS;
+}
+
+static void local_release(libusb_device_handle *udev)
+{
+	(void)udev;
+}
+
+static int local_bulk(libusb_device_handle *udev, unsigned char ep,
+	unsigned char *data, int size, int *actual_length)
+{
+	int ret;
+
+	(void)udev;
+	if (local.latency)
+		usleep(local.latency * 1000);
+	ret = local.answer(ep, data, size, actual_length);
+	if (ret == 0)
+		return LIBUSB_SUCCESS;
+	return ret == -ETIMEDOUT ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+}
+
+/*
+ * Complete the oldest transfer answered locally. The callbacks are called
+ * from the event loop, one by one, as libusb does. Each one waits for the
+ * latency, as if the sensor answered the transfers in turn.
+ */
+static void local_complete(void *data)
+{
+	struct libusb_transfer *transfer;
+
+	(void)data;
+	transfer = local.queue[local.head];
+	local.head = (local.head + 1) % LOCAL_QUEUE_MAX;
+	local.count--;
+	/* The callback may submit a transfer, the timeout must be added
+	 * before. */
+	if (local.count > 0
+	    && fpi_timeout_add(local.latency, local_complete, NULL) == NULL) {
+		fp_err("cannot add timeout, local transfers are stuck");
+	}
+	transfer->callback(transfer);
+}
+
+/*
+ * The transfer is answered at once and its callback is called from the event
+ * loop.
+ */
+static int local_submit(struct libusb_transfer *transfer)
+{
+	int ret;
+
+	if (local.count == LOCAL_QUEUE_MAX)
+		return LIBUSB_ERROR_BUSY;
+	if (local.count == 0
+	    && fpi_timeout_add(local.latency, local_complete, NULL) == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+	ret = local.answer(transfer->endpoint, transfer->buffer,
+			   transfer->length, &transfer->actual_length);
+	if (ret == -ETIMEDOUT)
+		transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+	else if (ret || ((transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK)
+			 && transfer->actual_length < transfer->length))
+		transfer->status = LIBUSB_TRANSFER_ERROR;
+	else
+		transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	local.queue[(local.head + local.count) % LOCAL_QUEUE_MAX] = transfer;
+	local.count++;
+	return LIBUSB_SUCCESS;
+}
+
+/*
+ * The completions are timeouts of the event loop, there is only to wait.
+ */
+static int local_poll(struct timeval *tv)
+{
+	struct timespec ts;
+
+	ts.tv_sec = tv->tv_sec;
+	ts.tv_nsec = tv->tv_usec * 1000;
+	nanosleep(&ts, NULL);
+	return LIBUSB_SUCCESS;
+}
+
+static const struct transport transport_local = {
+	.name = "local",
+	.claim = local_claim,
+	.release = local_release,
+	.bulk = local_bulk,
+	.submit = local_submit,
+	.poll = local_poll,
+};
+
+/*
+ * Return the transport of the transfers. They are answered locally from the
+ * trace given by ETES603_REPLAY or, in the tools, by the emulator if
+ * ETES603_EMULATE is set. Otherwise, the sensor is used.
+ */
+static const struct transport *transport_get(void)
+{
+	const char *path;
+
+	if (transport != NULL)
+		return transport;
+
+	transport = &transport_usb;
+	if ((path = getenv("ETES603_REPLAY")) != NULL && path[0] != '\0') {
+		if (!replay_open(path))
+			return transport;
+		local.answer = replay_transfer;
+#ifdef ETES603_EMULATOR
+	} else if (getenv("ETES603_EMULATE") != NULL) {
+		if (emu_open())
+			return transport;
+		local.answer = emu_transfer;
+		local.latency = emu_latency();
+#endif
+	} else {
+		return transport;
+	}
+	transport = &transport_local;
+	fp_dbg("transfers answered locally");
+	return transport;
+}
+
+/*
+ * Handle the completions of the transport for at most 'us' microseconds
+ * (for the tools).
+ */
+__attribute__((used))
+static int dev_transport_poll(long us)
+{
+	struct timeval tv;
+
+	tv.tv_sec = us / 1000000;
+	tv.tv_usec = us % 1000000;
+	return transport_get()->poll(&tv);
+}
+
+/*
+ * Return true if the transfers are answered without the sensor (for the
+ * tools).
+ */
+__attribute__((used))
+static int dev_transport_local(void)
+{
+	return transport_get() == &transport_local;
+}
+
+/*
+ * Called when an asynchronous transfer of the request 'req' completes: the
+ * transfer is logged, recorded in the trace and accounted.
+ */
+static void transfer_done(struct stats_req *req, struct libusb_transfer *transfer)
+{
+	int status = 0;
+
+	if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+		status = -ETIMEDOUT;
+	else if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		status = -EIO;
+	else
+		debug_output(transfer->endpoint, transfer->buffer,
+			     transfer->actual_length);
+	trace_record(transfer->endpoint, transfer->buffer,
+		     transfer->actual_length, status);
+	stats_transfer(req, transfer->endpoint, transfer->actual_length, status);
+}
+
+/*
+ * Transfer (in/out) egis command to the device using synchronous libusb.
+ * The transfer is accounted in the request 'req' (see stats_begin).
+ */
+static int sync_transfer(libusb_device_handle *udev, struct stats_req *req,
+		unsigned char ep, struct egis_msg *msg, unsigned int size)
+{
+	/* Not set by libusb if the transfer can not be submitted */
+	int ret, actual_length = 0;
+	unsigned char *data = (unsigned char *)msg;
 
-	ret = libusb_bulk_transfer(udev, ep, data, size, &actual_length,
-				   BULK_TIMEOUT);
+	ret = transport_get()->bulk(udev, ep, data, size, &actual_length);
 
 	if (ret < 0) {
 		fp_err("Bulk write error %s (%d)", libusb_error_name(ret), ret);
+		ret = (ret == LIBUSB_ERROR_TIMEOUT) ? -ETIMEDOUT : -EIO;
+		trace_record(ep, data, actual_length, ret);
+		stats_transfer(req, ep, 0, ret);
 		return -EIO;
 	}
 	debug_output(ep, data, actual_length);
+	trace_record(ep, data, actual_length, 0);
+	stats_transfer(req, ep, actual_length, 0);
 
 	return actual_length;
 }
@@ -357,109 +1180,175 @@ static void msg_get_fp(struct egis_msg *msg, uint8_t len0, uint8_t len1,
 /*
  * Ask synchronously the sensor for a frame.
  * if use_gvv is 0, gain/vrt/vrb are ineffective.
+ * The request is added to 'stats' (may be NULL), as for the functions below.
  */
-static int dev_get_frame(libusb_device_handle *udev, uint8_t length,
-	uint8_t use_gvv, uint8_t gain, uint8_t vrt, uint8_t vrb, uint8_t *buf)
+static int dev_get_frame(libusb_device_handle *udev, struct cmd_stats *stats,
+	uint8_t length, uint8_t use_gvv, uint8_t gain, uint8_t vrt, uint8_t vrb,
+	uint8_t *buf)
 {
 	struct egis_msg msg;
+	struct stats_req req;
 	int ret;
 	unsigned int i, fsize = length * 2;
 
 	msg_get_frame(&msg, length, use_gvv, gain, vrt, vrb);
 
-	ret = sync_transfer(udev, EP_OUT, &msg, MSG_HDR_SIZE + 6);
+	stats_begin(&req, msg.cmd);
+	ret = sync_transfer(udev, &req, EP_OUT, &msg, MSG_HDR_SIZE + 6);
 	if (ret < 0) {
 		fp_err("sync_transfer EP_OUT failed");
 		goto err;
 	}
 
 	for (i = 0 ; i < fsize; i += ret) {
-		ret = sync_transfer(udev, EP_IN, (struct egis_msg *)(buf + i),
-				    fsize - i);
+		ret = sync_transfer(udev, &req, EP_IN,
+				    (struct egis_msg *)(buf + i), fsize - i);
 		if (ret < 0) {
 			fp_err("sync_transfer EP_IN failed");
 			goto err;
 		}
 	}
 
+	stats_end(stats, &req);
 	return 0;
 err:
+	stats_end(stats, &req);
 	return -1;
 }
 
 /*
  * Ask synchronously the sensor for a fingerprint.
  */
-static int dev_get_fp(libusb_device_handle *udev, uint8_t *buf)
+static int dev_get_fp(libusb_device_handle *udev, struct cmd_stats *stats,
+	uint8_t *buf)
 {
 	struct egis_msg msg;
+	struct stats_req req;
 	int ret, i;
 
 	msg_get_fp(&msg, 0x01, 0xF4, 0x02, 0x01, 0x64);
 
-	ret = sync_transfer(udev, EP_OUT, &msg, MSG_HDR_SIZE + 5);
+	stats_begin(&req, msg.cmd);
+	ret = sync_transfer(udev, &req, EP_OUT, &msg, MSG_HDR_SIZE + 5);
 	if (ret < 0) {
 		fp_err("sync_transfer EP_OUT failed");
 		goto err;
 	}
 	for (i = 0 ; i < FRAMEFP_SIZE; i += ret) {
-		ret = sync_transfer(udev, EP_IN, (struct egis_msg *)(buf + i),
-				    FRAMEFP_SIZE - i);
+		ret = sync_transfer(udev, &req, EP_IN,
+				    (struct egis_msg *)(buf + i), FRAMEFP_SIZE - i);
 		if (ret < 0) {
 			fp_err("sync_transfer EP_IN failed");
 			goto err;
 		}
 	}
 
+	stats_end(stats, &req);
 	return 0;
 err:
+	stats_end(stats, &req);
 	return -1;
 }
 
 /*
- * Read synchronously a register from the sensor.
- * Variadic argument pattern: int reg, int *val, ...
+ * Send synchronously a CMD_READ_REG message, egis_readreg must be filled.
+ * The message is overwritten by the answer (sige_readreg).
  */
-static int dev_get_regs(libusb_device_handle *udev, int n_args, ... )
+static int dev_read_msg(libusb_device_handle *udev, struct cmd_stats *stats,
+	struct egis_msg *msg)
 {
-	va_list ap;
-	struct egis_msg msg;
-	int ret, i;
+	struct stats_req req;
+	int ret;
 
-	if (n_args == 0 || n_args % 2 != 0 || n_args > REG_MAX * 2) {
-		fp_err("wrong number of arguments (%d)", n_args);
+	msg_header_prepare(msg);
+	msg->cmd = CMD_READ_REG;
+
+	stats_begin(&req, msg->cmd);
+	ret = sync_transfer(udev, &req, EP_OUT, msg,
+			    MSG_HDR_SIZE + 1 + msg->egis_readreg.nb);
+	if (ret >= 0)
+		ret = sync_transfer(udev, &req, EP_IN, msg, sizeof(*msg));
+	stats_end(stats, &req);
+	if (ret < 0) {
+		fp_err("sync_transfer failed");
 		goto err;
 	}
-
-	msg_header_prepare(&msg);
-	msg.cmd = CMD_READ_REG;
-	msg.egis_readreg.nb = n_args / 2;
-
-	va_start(ap, n_args);
-	for (i = 0; i < n_args / 2; i++) {
-		msg.egis_readreg.regs[i] = va_arg(ap, int);
-		va_arg(ap, uint8_t*);
+	if (msg_header_check(msg)) {
+		fp_err("msg_header_check failed");
+		goto err;
 	}
-	va_end(ap);
-
-	ret = sync_transfer(udev, EP_OUT, &msg, MSG_HDR_SIZE + 1 + n_args / 2);
-	if (ret < 0) {
-		fp_err("sync_transfer EP_OUT failed");
+	if (msg->cmd != CMD_OK) {
+		fp_warn("CMD_OK failed");
 		goto err;
 	}
-	ret = sync_transfer(udev, EP_IN, &msg, sizeof(msg));
+	return 0;
+err:
+	return -1;
+}
+
+/*
+ * Send synchronously a CMD_WRITE_REG message, egis_writereg must be filled.
+ * The message is overwritten by the answer.
+ */
+static int dev_write_msg(libusb_device_handle *udev, struct cmd_stats *stats,
+	struct egis_msg *msg)
+{
+	struct stats_req req;
+	int ret;
+
+	msg_header_prepare(msg);
+	msg->cmd = CMD_WRITE_REG;
+
+	stats_begin(&req, msg->cmd);
+	ret = sync_transfer(udev, &req, EP_OUT, msg,
+			    MSG_HDR_SIZE + 1 + msg->egis_writereg.nb * 2);
+	if (ret >= 0)
+		ret = sync_transfer(udev, &req, EP_IN, msg, sizeof(*msg));
+	stats_end(stats, &req);
 	if (ret < 0) {
-		fp_err("sync_transfer EP_IN failed");
+		fp_err("sync_transfer failed");
 		goto err;
 	}
-	if (msg_header_check(&msg)) {
+	if (msg_header_check(msg)) {
 		fp_err("msg_header_check failed");
 		goto err;
 	}
-	if (msg.cmd != CMD_OK) {
+	if (msg->cmd != CMD_OK) {
 		fp_warn("CMD_OK failed");
 		goto err;
 	}
+	return 0;
+err:
+	return -1;
+}
+
+/*
+ * Read synchronously a register from the sensor without using the shadow
+ * copy (the sensor does not need to be opened).
+ * Variadic argument pattern: int reg, uint8_t *val, ...
+ */
+__attribute__((used))
+static int sync_get_regs(libusb_device_handle *udev, int n_args, ...)
+{
+	va_list ap;
+	struct egis_msg msg;
+	int i;
+
+	if (n_args == 0 || n_args % 2 != 0 || n_args > REG_MAX * 2) {
+		fp_err("wrong number of arguments (%d)", n_args);
+		return -1;
+	}
+
+	msg.egis_readreg.nb = n_args / 2;
+	va_start(ap, n_args);
+	for (i = 0; i < n_args / 2; i++) {
+		msg.egis_readreg.regs[i] = va_arg(ap, int);
+		va_arg(ap, uint8_t*);
+	}
+	va_end(ap);
+
+	if (dev_read_msg(udev, NULL, &msg))
+		return -1;
 
 	va_start(ap, n_args);
 	for (i = 0; i < n_args / 2; i++) {
@@ -471,27 +1360,24 @@ static int dev_get_regs(libusb_device_handle *udev, int n_args, ... )
 	va_end(ap);
 
 	return 0;
-err:
-	return -1;
 }
 
 /*
- * Write synchronously a register from the sensor.
+ * Write synchronously a register from the sensor without using the shadow
+ * copy (the sensor does not need to be opened).
  * Variadic arguments are: int reg, int val, ...
  */
-static int dev_set_regs(libusb_device_handle *udev, int n_args, ...)
+static int sync_set_regs(libusb_device_handle *udev, int n_args, ...)
 {
 	va_list ap;
 	struct egis_msg msg;
-	int ret, i;
+	int i;
 
 	if (n_args == 0 || n_args % 2 != 0 || n_args > REG_MAX * 2) {
 		fp_err("wrong number of arguments (%d)", n_args);
-		goto err;
+		return -1;
 	}
 
-	msg_header_prepare(&msg);
-	msg.cmd = CMD_WRITE_REG;
 	msg.egis_writereg.nb = n_args / 2;
 
 	va_start(ap, n_args);
@@ -501,158 +1387,223 @@ static int dev_set_regs(libusb_device_handle *udev, int n_args, ...)
 	}
 	va_end(ap);
 
-	ret = sync_transfer(udev, EP_OUT, &msg, MSG_HDR_SIZE + 1 + n_args);
-	if (ret < 0) {
-		fp_err("sync_transfer EP_OUT failed");
-		goto err;
-	}
-	ret = sync_transfer(udev, EP_IN, &msg, sizeof(msg));
-	if (ret < 0) {
-		fp_err("sync_transfer EP_IN failed");
-		goto err;
-	}
-	if (msg_header_check(&msg)) {
-		fp_err("msg_header_check failed");
-		goto err;
-	}
-	if (msg.cmd != CMD_OK) {
-		fp_warn("CMD_OK failed");
-		goto err;
+	return dev_write_msg(udev, NULL, &msg);
+}
+
+/*
+ * Return true if the value of the register can be kept in the shadow copy.
+ * REG_03 is never kept since it reflects the finger contact. The sensor
+ * changes its mode by itself (CMD_READ_FP), so REG_MODE_CONTROL is always
+ * written, and REG_50 is read again in contact mode as in captured traffic.
+ */
+static int reg_shadowed(int reg)
+{
+	return reg == REG_04 || reg == REG_10
+	    || reg == REG_1A || (reg >= REG_20 && reg <= REG_37)
+	    || (reg >= REG_ENC1 && reg <= REG_ENC8)
+	    || (reg > REG_50 && reg <= REG_5B)
+	    || (reg >= REG_INFO0 && reg <= REG_INFO3)
+	    || reg == REG_93 || reg == REG_94
+	    || (reg >= REG_GAIN && reg <= REG_DCOFFSET)
+	    || reg == REG_F0 || reg == REG_F2;
+}
+
+/*
+ * Return true if the value of the register is known in the shadow copy.
+ */
+static int reg_known(struct etes603_dev *dev, int reg)
+{
+	return (dev->regs_known[reg / 8] >> (reg % 8)) & 1;
+}
+
+/*
+ * Keep the value of the register in the shadow copy. The last value of a
+ * register which is not shadowed is kept too, for the sequences reading it,
+ * but it is never known.
+ */
+static void reg_update(struct etes603_dev *dev, int reg, uint8_t val)
+{
+	dev->regs[reg] = val;
+	if (!reg_shadowed(reg))
+		return;
+	dev->regs_known[reg / 8] |= 1 << (reg % 8);
+}
+
+/*
+ * Forget the value of the register, the next read will ask the sensor.
+ */
+static void reg_forget(struct etes603_dev *dev, int reg)
+{
+	dev->regs_known[reg / 8] &= ~(1 << (reg % 8));
+}
+
+/*
+ * Send the queued register writes in one CMD_WRITE_REG message.
+ */
+static int dev_flush_regs(struct etes603_dev *dev)
+{
+	struct egis_msg msg;
+	unsigned int i;
+
+	if (dev->wregs.egis_writereg.nb == 0)
+		return 0;
+	/* The message is overwritten by the answer, so send a copy. */
+	msg = dev->wregs;
+	if (dev_write_msg(dev->udev, dev->stats, &msg)) {
+		/* The sensor may have ignored these writes. */
+		for (i = 0; i < dev->wregs.egis_writereg.nb; i++)
+			reg_forget(dev, dev->wregs.egis_writereg.regs[i].reg);
+		dev->wregs.egis_writereg.nb = 0;
+		return -1;
 	}
+	dev->wregs.egis_writereg.nb = 0;
 	return 0;
-err:
-	return -1;
 }
 
 /*
- * Check the model of the sensor.
+ * Queue register writes, see dev_queue_regs.
  */
-static int check_info(struct etes603_dev *dev)
+static int dev_vqueue_regs(struct etes603_dev *dev, int n_args, va_list ap)
 {
-	uint8_t reg_70, reg_71, reg_72, reg_73;
+	struct egis_msg *msg = &dev->wregs;
+	int i, reg;
+	uint8_t val;
 
-	if (dev_get_regs(dev->udev, 8, REG_INFO0, &reg_70, REG_INFO1, &reg_71,
-		     REG_INFO2, &reg_72, REG_INFO3, &reg_73)) {
-		fp_err("cannot read device registers.");
-		goto err;
+	if (n_args == 0 || n_args % 2 != 0 || n_args > REG_MAX * 2) {
+		fp_err("wrong number of arguments (%d)", n_args);
+		return -1;
 	}
 
-	/* Check device */
-	if (reg_70 != 0x4A || reg_71 != 0x44 || reg_72 != 0x49
-	    || reg_73 != 0x31) {
-		fp_err("unknown device parameters (REG_70:%02X REG_71:%02X "
-		       "REG_FIRMWARE:%02X REG_VERSION:%02X)",
-		       reg_70, reg_71, reg_72, reg_73);
-		/* TODO Don't make it fails the time found all compatible
-		 * devices. */
-		/* goto err; */
+	for (i = 0; i < n_args / 2; i++) {
+		reg = va_arg(ap, int);
+		val = va_arg(ap, int);
+		/* Skip the write if the register has already this value. */
+		if (!reg_known(dev, reg) || dev->regs[reg] != val) {
+			if (msg->egis_writereg.nb == REG_MAX
+			    && dev_flush_regs(dev))
+				return -1;
+			msg->egis_writereg.regs[msg->egis_writereg.nb].reg = reg;
+			msg->egis_writereg.regs[msg->egis_writereg.nb].val = val;
+			msg->egis_writereg.nb++;
+			reg_update(dev, reg, val);
+		}
+		/* Ordering barrier, queued writes are sent even if the mode
+		 * is unchanged. */
+		if (reg == REG_MODE_CONTROL && dev_flush_regs(dev))
+			return -1;
 	}
 	return 0;
-err:
-	return -1;
 }
 
 /*
- * Ask command 0x20 to the sensor.
+ * Queue register writes to send them with the fewest CMD_WRITE_REG messages.
+ * The queue is sent when it is full, with dev_flush_regs and after a write of
+ * REG_MODE_CONTROL: a mode change ends a message (as in captured traffic) so
+ * that following writes apply in the new mode.
+ * Writes of a value already known in the shadow copy are skipped.
+ * A function queuing writes must flush them before any other request.
+ * Variadic arguments are: int reg, int val, ...
  */
-static int get_cmd20(struct etes603_dev *dev)
+static int dev_queue_regs(struct etes603_dev *dev, int n_args, ...)
 {
-	struct egis_msg msg;
+	va_list ap;
 	int ret;
 
-	msg_header_prepare(&msg);
-	msg.cmd = CMD_20;
+	va_start(ap, n_args);
+	ret = dev_vqueue_regs(dev, n_args, ap);
+	va_end(ap);
+	return ret;
+}
 
-	ret = sync_transfer(dev->udev, EP_OUT, &msg, MSG_HDR_SIZE);
-	if (ret < 0) {
-		fp_err("sync_transfer EP_OUT failed");
-		goto err;
-	}
-	ret = sync_transfer(dev->udev, EP_IN, &msg, sizeof(msg));
-	if (ret < 0) {
-		fp_err("sync_transfer EP_IN failed");
-		goto err;
-	}
-	if (msg_header_check(&msg)) {
-		fp_err("msg_header_check failed");
-		goto err;
-	}
-	/* status or flashtype/flashinfo or ? */
-	if (msg.cmd != 0x05
-	    || msg.sige_misc.val[0] != 0x00
-	    || msg.sige_misc.val[1] != 0x00) {
-		fp_warn("unexpected answer CMD_20 from device(%02X %02X %02X)",
-			msg.cmd, msg.sige_misc.val[0], msg.sige_misc.val[1]);
-	}
+/*
+ * Write synchronously a register from the sensor.
+ * Writes of a value already known in the shadow copy are skipped.
+ * Variadic arguments are: int reg, int val, ...
+ */
+static int dev_set_regs(struct etes603_dev *dev, int n_args, ...)
+{
+	va_list ap;
+	int ret;
 
-	return 0;
-err:
-	return -1;
+	va_start(ap, n_args);
+	ret = dev_vqueue_regs(dev, n_args, ap);
+	va_end(ap);
+	if (ret)
+		return ret;
+	return dev_flush_regs(dev);
 }
 
 /*
- * Ask command 0x25 to the sensor.
+ * Read synchronously a register from the sensor.
+ * When all values are known in the shadow copy, the sensor is not asked.
+ * Variadic argument pattern: int reg, uint8_t *val, ...
  */
-static int get_cmd25(struct etes603_dev *dev)
+static int dev_get_regs(struct etes603_dev *dev, int n_args, ...)
 {
+	va_list ap;
 	struct egis_msg msg;
-	int ret;
-
-	msg_header_prepare(&msg);
-	msg.cmd = CMD_25;
+	int i, reg, known = 1;
 
-	ret = sync_transfer(dev->udev, EP_OUT, &msg, MSG_HDR_SIZE);
-	if (ret < 0) {
-		fp_err("sync_transfer EP_OUT failed");
-		goto err;
-	}
-	ret = sync_transfer(dev->udev, EP_IN, &msg, sizeof(msg));
-	if (ret < 0) {
-		fp_err("sync_transfer EP_IN failed");
-		goto err;
-	}
-	if (msg_header_check(&msg)) {
-		fp_err("msg_header_check failed");
-		goto err;
+	if (n_args == 0 || n_args % 2 != 0 || n_args > REG_MAX * 2) {
+		fp_err("wrong number of arguments (%d)", n_args);
+		return -1;
 	}
-	if (msg.cmd != CMD_OK) {
-		fp_err("CMD_OK failed");
-		goto err;
+
+	msg.egis_readreg.nb = n_args / 2;
+	va_start(ap, n_args);
+	for (i = 0; i < n_args / 2; i++) {
+		reg = va_arg(ap, int);
+		va_arg(ap, uint8_t*);
+		msg.egis_readreg.regs[i] = reg;
+		known = known && reg_known(dev, reg);
 	}
-	/* flashtype or status or ? */
-	if (msg.sige_misc.val[0] != 0x00) {
-		fp_warn("unexpected answer for CMD_25 (%02X)",
-			msg.sige_misc.val[0]);
+	va_end(ap);
+
+	/* Queued writes must reach the sensor before reading it. */
+	if (!known && (dev_flush_regs(dev)
+		       || dev_read_msg(dev->udev, dev->stats, &msg)))
+		return -1;
+
+	va_start(ap, n_args);
+	for (i = 0; i < n_args / 2; i++) {
+		uint8_t *val;
+		reg = va_arg(ap, int);
+		val = va_arg(ap, uint8_t*);
+		if (known) {
+			*val = dev->regs[reg];
+		} else {
+			*val = msg.sige_readreg.regs[i];
+			reg_update(dev, reg, *val);
+		}
 	}
+	va_end(ap);
+
 	return 0;
-err:
-	return -1;
 }
-
 /*
- * Ask command 0x60 to the sensor.
+ * Ask command 0x60 to the sensor (LEDs): cmd 0x01 reads the value into 'reg',
+ * cmd 0x02 writes 'val'.
  */
-__attribute__((used))
-static int get_cmd60(struct etes603_dev *dev, uint8_t cmd, uint8_t val,
-	uint8_t *reg)
+static int dev_cmd60(libusb_device_handle *udev, struct cmd_stats *stats,
+	uint8_t cmd, uint8_t val, uint8_t *reg)
 {
 	struct egis_msg msg;
+	struct stats_req req;
 	int ret;
 
 	msg_header_prepare(&msg);
 	msg.cmd = CMD_60;
-	/* cmd 0x01: read / cmd 0x02: write */
 	msg.sige_misc.val[0] = cmd;
 	msg.sige_misc.val[1] = val;
 
-	ret = sync_transfer(dev->udev, EP_OUT, &msg, MSG_HDR_SIZE + cmd - 1);
-	if (ret < 0) {
-		fp_err("sync_transfer EP_OUT failed");
-		goto err_io;
-	}
-	ret = sync_transfer(dev->udev, EP_IN, &msg, sizeof(msg));
+	stats_begin(&req, msg.cmd);
+	/* cmd is followed by 'val' when writing. */
+	ret = sync_transfer(udev, &req, EP_OUT, &msg, MSG_HDR_SIZE + cmd);
+	if (ret >= 0)
+		ret = sync_transfer(udev, &req, EP_IN, &msg, sizeof(msg));
+	stats_end(stats, &req);
 	if (ret < 0) {
-		fp_err("sync_transfer EP_IN failed");
+		fp_err("sync_transfer failed");
 		goto err_io;
 	}
 	if (msg_header_check(&msg)) {
@@ -674,331 +1625,910 @@ err_cmd:
 	return -2;
 }
 
-/*
- * Change the mode of the sensor.
- */
-static int set_mode_control(struct etes603_dev *dev, uint8_t mode)
+__attribute__((used))
+static int get_cmd60(struct etes603_dev *dev, uint8_t cmd, uint8_t val,
+	uint8_t *reg)
 {
-	if (dev_set_regs(dev->udev, 2, REG_MODE_CONTROL, mode))
-		return -1;
-	return 0;
+	return dev_cmd60(dev->udev, dev->stats, cmd, val, reg);
 }
 
 /*
- * Initialize the sensor by setting some registers.
+ * Same without opening the sensor (for the tools).
  */
-static int init(struct etes603_dev *dev)
+__attribute__((used))
+static int sync_cmd60(libusb_device_handle *udev, uint8_t cmd, uint8_t val,
+	uint8_t *reg)
 {
-	if (set_mode_control(dev, REG_MODE_SLEEP))
-		return -1;
-	if (dev_set_regs(dev->udev, 2, REG_50, 0x0F))
-		return -2;
-	if (dev_set_regs(dev->udev, 2, REG_GAIN, 0x04))
-		return -3;
-	if (dev_set_regs(dev->udev, 2, REG_VRT, 0x08))
-		return -4;
-	if (dev_set_regs(dev->udev, 2, REG_VRB, 0x0D))
-		return -5;
-	if (dev_set_regs(dev->udev, 2, REG_VCO_CONTROL, REG_VCO_RT))
-		return -6;
-	if (dev_set_regs(dev->udev, 2, REG_DCOFFSET, 0x36))
-		return -7;
-	if (dev_set_regs(dev->udev, 2, REG_F0, 0x00))
-		return -8;
-	if (dev_set_regs(dev->udev, 2, REG_F2, 0x00))
-		return -9;
-	return 0;
+	return dev_cmd60(udev, NULL, cmd, val, reg);
 }
 
 /*
- * This function sets encryption registers to no encryption.
+ * Change the mode of the sensor.
  */
-static int init_enc(struct etes603_dev *dev)
+static int set_mode_control(struct etes603_dev *dev, uint8_t mode)
 {
-	/* Initialize encryption. */
-	/* Set registers from 0x41 to 0x48 (0x8 regs) */
-	if (dev_set_regs(dev->udev, 16, REG_ENC1, 0x12, REG_ENC2, 0x34,
-		     REG_ENC3, 0x56, REG_ENC4, 0x78, REG_ENC5, 0x90,
-		     REG_ENC6, 0xAB, REG_ENC7, 0xCD, REG_ENC8, 0xEF)) {
-		fp_err("Failed");
+	/* The mode change sends the queued writes. */
+	if (dev_queue_regs(dev, 2, REG_MODE_CONTROL, mode))
 		return -1;
-	}
 	return 0;
 }
 
 /*
- * This function set registers 0x20 to 0x37 to default values.
+ * Write in 'path' the calibration cache of the sensor: the file given by
+ * ETES603_CALIBRATION (or CALIBRATION_FILE) followed by the USB port path of
+ * the sensor (".bus-port.port"), since sensors of the same model do not have
+ * the same values. The transfers answered locally use ".local".
+ * Return -1 if the cache is disabled or the port path is unknown.
  */
-static int init_regs(struct etes603_dev *dev)
+static int calibration_path(struct etes603_dev *dev, char *path, size_t size)
 {
-	/* Set register from 0x20 to 0x37 (0x18 regs) */
-	if (dev_set_regs(dev->udev, 48,
-		     REG_20, 0x00, REG_21, 0x23, REG_22, 0x21, REG_23, 0x20,
-		     REG_24, 0x14, REG_25, 0x6A, REG_26, 0x00, REG_27, 0x00,
-		     REG_28, 0x00, REG_29, 0xC0, REG_2A, 0x50, REG_2B, 0x50,
-		     REG_2C, 0x4D, REG_2D, 0x03, REG_2E, 0x06, REG_2F, 0x06,
-		     REG_30, 0x10, REG_31, 0x02, REG_32, 0x14, REG_33, 0x34,
-		     REG_34, 0x01, REG_35, 0x08, REG_36, 0x03, REG_37, 0x21)) {
-		fp_err("Failed");
+	const char *file;
+	libusb_device *udev;
+	uint8_t ports[CALIBRATION_PORTS];
+	int n, i, len;
+
+	if ((file = getenv("ETES603_CALIBRATION")) == NULL)
+		file = CALIBRATION_FILE;
+	if (file[0] == '\0')
 		return -1;
+	if (dev->udev == NULL) {
+		len = snprintf(path, size, "%s.local", file);
+		return len < (int)size ? 0 : -1;
 	}
-	return 0;
+	udev = libusb_get_device(dev->udev);
+	if ((n = libusb_get_port_numbers(udev, ports, sizeof(ports))) < 1)
+		return -1;
+	len = snprintf(path, size, "%s.%u-%u", file,
+		       libusb_get_bus_number(udev), ports[0]);
+	for (i = 1; i < n && len < (int)size; i++)
+		len += snprintf(path + len, size - len, ".%u", ports[i]);
+	return len < (int)size ? 0 : -1;
 }
 
 /*
- * This function tunes the DCoffset value and adjusts the gain value if
- * required.
+ * Load the tuned values from the calibration cache.
+ * Return 0 if the cache of this sensor exists and was written for its model.
+ * The values must still be checked against the sensor (see OPEN_CALIB).
  */
-static int tune_dc(struct etes603_dev *dev)
+static int calibration_load(struct etes603_dev *dev, uint8_t *reg_dc)
 {
-	uint8_t buf[FRAME_SIZE];
-	uint8_t min, max;
-	uint8_t dcoffset, gain;
+	char path[256];
+	FILE *f;
+	unsigned int info[4], v[7];
+	int n, i;
 
-	fp_dbg("Tuning DCoffset");
-	/* TODO To get better results, tuning must be done 3 times as in
-	 * captured traffic to make sure that the value is correct. */
-	/* The default gain should work but it may reach a DCOffset limit so in this
-	 * case we decrease the gain. */
-	for (gain = GAIN_SMALL_INIT; ; gain--) {
-		min = DCOFFSET_MIN;
-		max = DCOFFSET_MAX;
-		/* Dichotomic search to find at which value the frame becomes
-		 * almost black. */
-		while (min + 1 < max) {
-			dcoffset = (max + min) / 2;
-			fp_dbg("Testing DCoffset=0x%02X Gain=0x%02X", dcoffset, gain);
-			if (dev_set_regs(dev->udev, 2, REG_DCOFFSET, dcoffset))
-				goto err_tunedc;
-			/* vrt:0x15 vrb:0x10 are constant in all tuning frames. */
-			if (dev_get_frame(dev->udev, FRAME_WIDTH, 0x01, gain, 0x15, 0x10, buf))
-				goto err_tunedc;
-			if (process_frame_empty(buf, FRAME_SIZE, 0))
-				max = dcoffset;
-			else
-				min = dcoffset;
-		}
-		if (max < DCOFFSET_MAX) {
-			dcoffset = max + 1;
-			break;
+	if (calibration_path(dev, path, sizeof(path)))
+		return -1;
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	n = fscanf(f, CALIBRATION_MAGIC " %02X%02X%02X%02X"
+		   " %02X %02X %02X %02X %02X %02X %02X",
+		   &info[0], &info[1], &info[2], &info[3],
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]);
+	fclose(f);
+	if (n != 11) {
+		fp_warn("invalid calibration cache %s", path);
+		return -1;
+	}
+	for (i = 0; i < 4; i++) {
+		if (info[i] != dev->info[i]) {
+			fp_dbg("calibration cache is for another sensor");
+			return -1;
 		}
 	}
-	fp_dbg("-> DCoffset=0x%02X Gain=0x%02X", dcoffset, gain);
-	dev->gain = gain;
-	dev->dcoffset = dcoffset;
-
-	/* ??? how reg21 / reg22 are calculated */
-	if (dev_set_regs(dev->udev, 4, REG_21, 0x23, REG_22, 0x21))
-		goto err_write;
-	if (dev_set_regs(dev->udev, 2, REG_GAIN, gain))
-		goto err_write;
-	if (dev_set_regs(dev->udev, 2, REG_DCOFFSET, dcoffset))
-		goto err_write;
-	/* In captured traffic, read REG_GAIN, REG_VRT, and REG_VRB registers. */
-
+	/* Same limits as the tuning functions, DTVRT is 5 above a tested
+	 * value. */
+	if (v[0] == 0 || v[0] > GAIN_SMALL_INIT || v[1] == 0
+	    || v[1] > DCOFFSET_MAX || v[2] == 0 || v[2] > VRT_MAX
+	    || v[3] == 0 || v[3] > VRB_MAX || v[4] <= 5 || v[4] > DTVRT_MAX + 5
+	    || v[5] == 0 || v[5] > DCOFFSET_MAX) {
+		fp_warn("invalid calibration values in %s", path);
+		return -1;
+	}
+	dev->gain = v[0];
+	dev->dcoffset = v[1];
+	dev->vrt = v[2];
+	dev->vrb = v[3];
+	dev->dtvrt = v[4];
+	dev->dcoffset_ct = v[5];
+	*reg_dc = v[6];
 	return 0;
-err_tunedc:
-	fp_err("Error tuning DC/gain parameter");
-	return -1;
-err_write:
-	fp_err("Error setting registers");
-	return -2;
 }
 
 /*
- * This function tunes the value for DTVRT and adjusts DCOFFSET if needed.
+ * Save the tuned values to the calibration cache, reg_dc is the DCoffset set
+ * after tuning VRT/VRB (it may differ from dev->dcoffset).
+ * A failure is not an error, the sensor will be tuned again next time.
+ * The write blocks the caller (the event thread during the open): the file is
+ * one line in /var/cache, written only when the sensor was tuned.
  */
-static int tune_dtvrt(struct etes603_dev *dev)
+static void calibration_save(struct etes603_dev *dev, uint8_t reg_dc)
 {
-	uint8_t reg_e5;
-	uint8_t reg_50, reg_51;
-	uint8_t reg_59, reg_5a, reg_5b;
-	uint8_t dtvrt;
-	uint8_t dcoffset_ct;
-
-	assert(dev->dcoffset);
-	/* Use DCOffset for frame capture as default. */
-	dcoffset_ct = dev->dcoffset;
-
-	/* Save registers to reset it at the end. */
-	if (dev_get_regs(dev->udev, 2, REG_VCO_CONTROL, &reg_e5))
-		goto err_rw;
-	if (dev_get_regs(dev->udev, 4, REG_50, &reg_50, REG_51, &reg_51))
-		goto err_rw;
-	if (dev_get_regs(dev->udev, 6, REG_59, &reg_59, REG_5A, &reg_5a, REG_5B, &reg_5b))
-		goto err_rw;
+	char path[256], tmp[256 + 4];
+	FILE *f;
 
-restart:
-	if (set_mode_control(dev, REG_MODE_SLEEP))
-		goto err_rw;
-	if (dev_set_regs(dev->udev, 2, REG_DCOFFSET, dcoffset_ct))
-		goto err_rw;
-	if (dev_set_regs(dev->udev, 2, REG_VCO_CONTROL, REG_VCO_IDLE))
-		goto err_rw;
-	if (dev_set_regs(dev->udev, 2, REG_50, reg_50 | 0x80))
-		goto err_rw;
-	if (dev_set_regs(dev->udev, 2, REG_51, reg_51 & 0xF7))
-		goto err_rw;
-	if (dev_set_regs(dev->udev, 6, REG_59, 0x18, REG_5A, 0x08, REG_5B, 0x00))
-		goto err_rw;
-
-	if (set_mode_control(dev, REG_MODE_CONTACT))
-		goto err_rw;
-
-	fp_dbg("Tuning of DTVRT");
-	dtvrt = DTVRT_MAX;
-	if (dev_set_regs(dev->udev, 2, REG_DTVRT, dtvrt))
-		goto err_tune;
-	/* Arbitrary lowest value for DCOffset. */
-	while (!contact_detect(dev) && dcoffset_ct > 0x10) {
-		if (dtvrt > 5) {
-			dtvrt -= 5;
-		} else {
-			/* Decrease DCoffset if cannot adjust a value for
-			 * DTVRT. */
-			dcoffset_ct--;
-			fp_dbg("Decrease DCoffset=0x%02X for contact "
-				"detection (DTVRT)", dcoffset_ct);
-			goto restart;
-		}
-		fp_dbg("Testing DTVRT=0x%02X DCoffset=0x%02X", dtvrt, dcoffset_ct);
-		if (dev_set_regs(dev->udev, 2, REG_DTVRT, dtvrt))
-			goto err_tune;
+	if (calibration_path(dev, path, sizeof(path)))
+		return;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return;
+	/* Write a temporary file and rename it to never leave a partial
+	 * cache. */
+	if ((f = fopen(tmp, "w")) == NULL)
+		goto err;
+	fprintf(f, CALIBRATION_MAGIC " %02X%02X%02X%02X"
+		" %02X %02X %02X %02X %02X %02X %02X\n",
+		dev->info[0], dev->info[1], dev->info[2], dev->info[3],
+		dev->gain, dev->dcoffset, dev->vrt, dev->vrb, dev->dtvrt,
+		dev->dcoffset_ct, reg_dc);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		goto err;
 	}
-	dtvrt += 5;
-	fp_dbg("-> DTVRT=0x%02X DCoffset=0x%02X", dtvrt, dcoffset_ct);
-	dev->dtvrt = dtvrt;
-	dev->dcoffset_ct = dcoffset_ct;
+	fp_dbg("calibration saved in %s", path);
+	return;
+err:
+	fp_warn("cannot write calibration cache %s (%s)", path, strerror(errno));
+}
 
-	if (set_mode_control(dev, REG_MODE_SLEEP))
-		goto err_rw;
-	/* Reset registers value from initial values. */
-	if (dev_set_regs(dev->udev, 2, REG_VCO_CONTROL, reg_e5))
-		goto err_rw;
-	if (dev_set_regs(dev->udev, 4, REG_50, reg_50, REG_51, reg_51))
-		goto err_rw;
-	if (dev_set_regs(dev->udev, 6, REG_59, reg_59, REG_5A, reg_5a, REG_5B, reg_5b))
-		goto err_rw;
-	/* Reset DCOffset for frame capturing. */
-	if (dev_set_regs(dev->udev, 2, REG_DCOFFSET, dev->dcoffset))
-		goto err_rw;
-	/* Set value found for DTVRT. */
-	if (dev_set_regs(dev->udev, 2, REG_DTVRT, dtvrt))
-		goto err_rw;
+/*
+ * Request sequences
+ *
+ * Sequences of requests sent to the sensor without blocking: each step of a
+ * sequence prepares one request in dev->msg and the next step processes its
+ * answer in dev->buf. A step may also ask to wait some time before the next
+ * one. The requests are sent with asynchronous transfers by seq_run.
+ */
 
-	return 0;
-err_rw:
-	fp_err("cannot read/write registers");
-	return -1;
-err_tune:
-	fp_err("error tuning DTVRT/DCoffset (cannot write registers)");
-	return -2;
-}
+/* Return values of the steps (or < 0 on error) */
+#define SEQ_DONE           0 /* The sequence is finished */
+#define SEQ_REQUEST        1 /* A request is prepared */
+#define SEQ_WAIT           2 /* Wait dev->delay ms before the next step */
 
 /*
- * Tune value of VRT and VRB for contrast and brightness.
+ * Prepare a request without parameters.
  */
-static int tune_vrb(struct etes603_dev *dev)
+static void seq_cmd(struct etes603_dev *dev, uint8_t cmd)
 {
-	static const unsigned int BW = 0x08; /* Border width*/
-	static const unsigned int FBW = FRAME_WIDTH / 2; /* Frame byte width */
-	uint8_t buf[FRAME_SIZE];
-	/* VRT(reg E1)=0x0A and VRB(reg E2)=0x10 are starting values */
-	/* reg_e0 = 0x23 is sensor normal/small gain */
-	uint8_t reg_gain, reg_vrt = 0x0A, reg_vrb = 0x10, reg_dc;
-	unsigned int i, j;
-	double hist[16];
-	double white_mean, black_mean;
+	msg_header_prepare(&dev->msg);
+	dev->msg.cmd = cmd;
+	dev->op_size = MSG_HDR_SIZE;
+	dev->op_frame = 0;
+}
 
-	fp_dbg("Tuning of VRT/VRB");
+/*
+ * Prepare a CMD_READ_REG request.
+ * Returns 0 (no request) if all values are known in the shadow copy, the
+ * answer updates the shadow copy (see seq_answer).
+ * Variadic arguments are: int reg, ...
+ */
+static int seq_read_regs(struct etes603_dev *dev, int n_regs, ...)
+{
+	struct egis_msg *msg = &dev->msg;
+	va_list ap;
+	int i, reg, known = 1;
+
+	assert(n_regs > 0 && n_regs <= REG_MAX);
+	seq_cmd(dev, CMD_READ_REG);
+	msg->egis_readreg.nb = n_regs;
+	va_start(ap, n_regs);
+	for (i = 0; i < n_regs; i++) {
+		reg = va_arg(ap, int);
+		msg->egis_readreg.regs[i] = reg;
+		known = known && reg_known(dev, reg);
+	}
+	va_end(ap);
+	dev->op_size = MSG_HDR_SIZE + 1 + n_regs;
+	return !known;
+}
 
-	if (dev_get_regs(dev->udev, 2, REG_GAIN, &reg_gain))
-		goto err;
+/*
+ * Prepare a CMD_WRITE_REG request.
+ * Writes of a value already known in the shadow copy are skipped. As in
+ * dev_queue_regs, a mode change ends a message so it must be the last write.
+ * Returns the number of registers written (no request if 0).
+ * Variadic arguments are: int reg, int val, ...
+ */
+static int seq_write_regs(struct etes603_dev *dev, int n_args, ...)
+{
+	struct egis_msg *msg = &dev->msg;
+	va_list ap;
+	int i, reg;
+	uint8_t val;
 
-	/* Reduce DCoffset by 1 to allow tuning */
-	if (dev_get_regs(dev->udev, 2, REG_DCOFFSET, &reg_dc))
-		goto err;
-	if (dev_set_regs(dev->udev, 2, REG_DCOFFSET, reg_dc - 1))
-		goto err;
+	assert(n_args > 0 && n_args % 2 == 0 && n_args <= REG_MAX * 2);
+	seq_cmd(dev, CMD_WRITE_REG);
+	msg->egis_writereg.nb = 0;
+	va_start(ap, n_args);
+	for (i = 0; i < n_args / 2; i++) {
+		reg = va_arg(ap, int);
+		val = va_arg(ap, int);
+		if (reg_known(dev, reg) && dev->regs[reg] == val)
+			continue;
+		msg->egis_writereg.regs[msg->egis_writereg.nb].reg = reg;
+		msg->egis_writereg.regs[msg->egis_writereg.nb].val = val;
+		msg->egis_writereg.nb++;
+		reg_update(dev, reg, val);
+	}
+	va_end(ap);
+	dev->op_size = MSG_HDR_SIZE + 1 + msg->egis_writereg.nb * 2;
+	return msg->egis_writereg.nb;
+}
 
-	while (reg_vrt < VRT_MAX && reg_vrb < VRB_MAX) {
-		fp_dbg("Testing VRT=0x%02X VRB=0x%02X", reg_vrt, reg_vrb);
-		/* Clean histogram */
-		for (i = 0; i < 16; i++)
-			hist[i] = 0.0;
-		if (dev_get_frame(dev->udev, FRAME_WIDTH, 0x01, reg_gain,
-				  reg_vrt, reg_vrb, buf))
-			goto err;
-		/* fill up histogram using 4 rows of the frame */
-		for (j = 0; j < FRAME_HEIGHT; j++) {
-			/* only center pixels (0x50 pixels) */
-			for (i = BW + j * FBW; i < FBW - BW + j * FBW; i++)
-				hist[buf[i] >> 4]++;
-		}
-		/* histogram average */
-		for (i = 0; i < 16; i++) {
-			hist[i] = hist[i] / ((FBW - BW * 2) * FRAME_HEIGHT);
-		}
-		/* Average black/white pixels (full black and full white pixels
-		 * are excluded). */
-		black_mean = white_mean = 0.0;
-		for (i = 1; i < 8; i++)
-			black_mean += hist[i];
-		for (i = 8; i < 15; i++)
-			white_mean += hist[i];
-		fp_dbg("fullb=%6f black=%6f grey=%6f white=%6f fullw=%6f",
-			hist[0], black_mean, black_mean+white_mean, white_mean,
-			hist[15]);
-
-		/* Tuning VRT/VRB -> contrast and brightness */
-		if (hist[0] + black_mean > 0.95) {
-			fp_dbg("Image is too dark, reducing DCoffset");
-			reg_dc--;
-			dev_set_regs(dev->udev, 2, REG_DCOFFSET, reg_dc-1);
-			//break;
-		}
-		if (hist[15] > 0.95) {
-			fp_dbg("Image is too bright, trying increase DCoffset");
-			reg_dc++;
-			dev_set_regs(dev->udev, 2, REG_DCOFFSET, reg_dc-1);
-			//break;
-		}
-		if ((black_mean > 0.1) && (white_mean > 0.1) && (black_mean + white_mean > 0.4)) {
-			/* The image seems balanced. */
-			break;
-		}
-		if (reg_vrt >= 2 * reg_vrb - 0x0a) {
-			reg_vrt++; reg_vrb++;
-		} else {
-			reg_vrt++;
-		}
-		/* Check maximum for vrt/vrb */
-		/* TODO if maximum is reached, leave with an error? */
-		if (reg_vrt > VRT_MAX)
-			reg_vrt = VRT_MAX;
-		if (reg_vrb > VRB_MAX)
-			reg_vrb = VRB_MAX;
+/*
+ * Prepare a request for a tuning frame (gain/vrt/vrb are used).
+ */
+static void seq_get_frame(struct etes603_dev *dev, uint8_t gain, uint8_t vrt,
+	uint8_t vrb)
+{
+	msg_get_frame(&dev->msg, FRAME_WIDTH, 0x01, gain, vrt, vrb);
+	dev->op_size = MSG_HDR_SIZE + 6;
+	dev->op_frame = 1;
+}
 
-	}
-	fp_dbg("-> VRT=0x%02X VRB=0x%02X", reg_vrt, reg_vrb);
-	dev->vrt = reg_vrt;
-	dev->vrb = reg_vrb;
+/*
+ * Called when the request failed: the sensor may have ignored its writes.
+ */
+static void seq_failed(struct etes603_dev *dev)
+{
+	int i;
 
-	/* Reset the DCOffset */
-	if (dev_set_regs(dev->udev, 2, REG_DCOFFSET, reg_dc))
-		goto err;
-	/* In traces, REG_26/REG_27 are set. purpose? values? */
-	if (dev_set_regs(dev->udev, 4, REG_26, 0x11, REG_27, 0x00))
-		goto err;
-	/* Set Gain/VRT/VRB values found */
-	if (dev_set_regs(dev->udev, 6, REG_GAIN, reg_gain, REG_VRT, reg_vrt, REG_VRB, reg_vrb))
-		goto err;
-	/* In traces, Gain/VRT/VRB are read again. */
+	if (dev->msg.cmd != CMD_WRITE_REG)
+		return;
+	for (i = 0; i < dev->msg.egis_writereg.nb; i++)
+		reg_forget(dev, dev->msg.egis_writereg.regs[i].reg);
+}
+
+/*
+ * Check the answer of the request and keep the registers read in the shadow
+ * copy.
+ */
+static int seq_answer(struct etes603_dev *dev, int len)
+{
+	struct egis_msg *ans = (struct egis_msg *)dev->buf;
+	int i;
 
+	if (dev->op_frame)
+		return len == FRAME_SIZE ? 0 : -1;
+	if (len < MSG_HDR_SIZE || msg_header_check(ans)) {
+		fp_err("msg_header_check failed");
+		return -1;
+	}
+	if (dev->msg.cmd != CMD_READ_REG && dev->msg.cmd != CMD_WRITE_REG)
+		return 0;
+	if (ans->cmd != CMD_OK) {
+		fp_warn("CMD_OK failed");
+		return -1;
+	}
+	if (dev->msg.cmd == CMD_READ_REG) {
+		if (len < MSG_HDR_SIZE + dev->msg.egis_readreg.nb)
+			return -1;
+		for (i = 0; i < dev->msg.egis_readreg.nb; i++)
+			reg_update(dev, dev->msg.egis_readreg.regs[i],
+				   ans->sige_readreg.regs[i]);
+	}
 	return 0;
-err:
-	fp_err("cannot read/write registers");
-	return -1;
+}
+
+/*
+ * Open sequence
+ *
+ * The sensor is initialized and tuned without blocking the event loop.
+ */
+
+/* Steps of the open sequence */
+#define OPEN_INFO                  1    /* Check the model of the sensor */
+#define OPEN_INFO_ANS              2
+#define OPEN_CMD20                 3
+#define OPEN_CMD20_ANS             4
+#define OPEN_CMD25                 5
+#define OPEN_CMD25_ANS             6
+#define OPEN_INIT                  7    /* Initialize the sensor registers */
+#define OPEN_INIT_REGS             8
+#define OPEN_INIT_ENC              9
+#define OPEN_INIT_DEFAULT          10
+#define OPEN_CALIB                 11   /* Use the calibration cache */
+#define OPEN_CALIB_FRAME           12
+#define OPEN_CALIB_ANS             13
+#define OPEN_CALIB_LOW_FRAME       14
+#define OPEN_CALIB_LOW_ANS         15
+#define OPEN_CALIB_DTVRT           16
+#define OPEN_CALIB_VRB             17
+#define OPEN_CALIB_VRB_FRAME       18
+#define OPEN_CALIB_VRB_ANS         19
+#define OPEN_CALIB_OK              20
+#define OPEN_DC                    21   /* Tune DCoffset and gain */
+#define OPEN_DC_SET                22
+#define OPEN_DC_FRAME              23
+#define OPEN_DC_ANS                24
+#define OPEN_DC_END                25
+#define OPEN_DTVRT                 26   /* Tune DTVRT */
+#define OPEN_DTVRT_SAVE50          27
+#define OPEN_DTVRT_SAVE59          28
+#define OPEN_DTVRT_START           29
+#define OPEN_DTVRT_RESTART         30
+#define OPEN_DTVRT_CONTACT         31
+#define OPEN_DTVRT_SET             32
+#define OPEN_DTVRT_DETECT          33
+#define OPEN_DTVRT_ANS             34
+#define OPEN_DTVRT_END             35
+#define OPEN_DTVRT_RESET           36
+#define OPEN_VRB                   37   /* Tune VRT and VRB */
+#define OPEN_VRB_START             38
+#define OPEN_VRB_FRAME             39
+#define OPEN_VRB_ANS               40
+#define OPEN_VRB_END               41
+#define OPEN_CONFIGURE             42
+#define OPEN_DONE                  43
+
+/*
+ * Check the contrast of a VRT/VRB tuning frame: return 1 if the black and
+ * white pixels are balanced. 'dark' is set to the part of the full black and
+ * black pixels, 'bright' to the part of the full white pixels.
+ */
+static int tune_frame_balanced(uint8_t *frame, double *dark, double *bright)
+{
+	struct frame_desc fd;
+	unsigned int i, total;
+	double hist[16];
+	double white_mean, black_mean;
+
+	process_frame_describe(&fd, frame);
+	process_frame_histogram(&fd);
+	/* histogram average */
+	for (i = 0, total = 0; i < 16; i++)
+		total += fd.hist[i];
+	for (i = 0; i < 16; i++)
+		hist[i] = (double)fd.hist[i] / total;
+	/* Average black/white pixels (full black and full white pixels are
+	 * excluded). */
+	black_mean = white_mean = 0.0;
+	for (i = 1; i < 8; i++)
+		black_mean += hist[i];
+	for (i = 8; i < 15; i++)
+		white_mean += hist[i];
+	fp_dbg("fullb=%6f black=%6f grey=%6f white=%6f fullw=%6f",
+		hist[0], black_mean, black_mean+white_mean,
+		white_mean, hist[15]);
+	*dark = hist[0] + black_mean;
+	*bright = hist[15];
+	return (black_mean > 0.1) && (white_mean > 0.1)
+	       && (black_mean + white_mean > 0.4);
+}
+
+/*
+ * Step of the open sequence.
+ */
+static int open_step(struct etes603_dev *dev)
+{
+	struct egis_msg *ans = (struct egis_msg *)dev->buf;
+	struct tune_state *t = &dev->tune;
+	unsigned int i;
+	double dark, bright;
+	int contact;
+
+	for (;;) {
+		switch (dev->step) {
+		case OPEN_INFO:
+			dev->step = OPEN_INFO_ANS;
+			if (seq_read_regs(dev, 4, REG_INFO0, REG_INFO1,
+					   REG_INFO2, REG_INFO3))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_INFO_ANS:
+			for (i = 0; i < 4; i++)
+				dev->info[i] = dev->regs[REG_INFO0 + i];
+			/* Check device */
+			if (dev->info[0] != 0x4A || dev->info[1] != 0x44
+			    || dev->info[2] != 0x49 || dev->info[3] != 0x31) {
+				fp_err("unknown device parameters (REG_70:%02X "
+				       "REG_71:%02X REG_FIRMWARE:%02X "
+				       "REG_VERSION:%02X)", dev->info[0],
+				       dev->info[1], dev->info[2], dev->info[3]);
+				/* TODO Don't make it fails the time found all
+				 * compatible devices. */
+			}
+			dev->step = OPEN_CMD20;
+			continue;
+
+		case OPEN_CMD20:
+			seq_cmd(dev, CMD_20);
+			dev->step = OPEN_CMD20_ANS;
+			return SEQ_REQUEST;
+
+		case OPEN_CMD20_ANS:
+			/* status or flashtype/flashinfo or ? */
+			if (ans->cmd != 0x05 || ans->sige_misc.val[0] != 0x00
+			    || ans->sige_misc.val[1] != 0x00) {
+				fp_warn("unexpected answer CMD_20 from device"
+					"(%02X %02X %02X)", ans->cmd,
+					ans->sige_misc.val[0],
+					ans->sige_misc.val[1]);
+			}
+			dev->step = OPEN_CMD25;
+			continue;
+
+		case OPEN_CMD25:
+			seq_cmd(dev, CMD_25);
+			dev->step = OPEN_CMD25_ANS;
+			return SEQ_REQUEST;
+
+		case OPEN_CMD25_ANS:
+			if (ans->cmd != CMD_OK) {
+				fp_err("CMD_OK failed");
+				return -1;
+			}
+			/* flashtype or status or ? */
+			if (ans->sige_misc.val[0] != 0x00) {
+				fp_warn("unexpected answer for CMD_25 (%02X)",
+					ans->sige_misc.val[0]);
+			}
+			dev->step = OPEN_INIT;
+			continue;
+
+		case OPEN_INIT:
+			dev->step = OPEN_INIT_REGS;
+			if (seq_write_regs(dev, 2, REG_MODE_CONTROL, REG_MODE_SLEEP))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_INIT_REGS:
+			dev->step = OPEN_INIT_ENC;
+			if (seq_write_regs(dev, 16, REG_50, 0x0F, REG_GAIN, 0x04,
+				     REG_VRT, 0x08, REG_VRB, 0x0D,
+				     REG_VCO_CONTROL, REG_VCO_RT,
+				     REG_DCOFFSET, 0x36, REG_F0, 0x00,
+				     REG_F2, 0x00))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_INIT_ENC:
+			/* Initialize encryption to no encryption. */
+			/* Set registers from 0x41 to 0x48 (0x8 regs) */
+			dev->step = OPEN_INIT_DEFAULT;
+			if (seq_write_regs(dev, 16, REG_ENC1, 0x12, REG_ENC2, 0x34,
+				     REG_ENC3, 0x56, REG_ENC4, 0x78,
+				     REG_ENC5, 0x90, REG_ENC6, 0xAB,
+				     REG_ENC7, 0xCD, REG_ENC8, 0xEF))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_INIT_DEFAULT:
+			/* Set register from 0x20 to 0x37 (0x18 regs) to default
+			 * values. */
+			dev->step = OPEN_CALIB;
+			if (seq_write_regs(dev, 48,
+				     REG_20, 0x00, REG_21, 0x23, REG_22, 0x21,
+				     REG_23, 0x20, REG_24, 0x14, REG_25, 0x6A,
+				     REG_26, 0x00, REG_27, 0x00, REG_28, 0x00,
+				     REG_29, 0xC0, REG_2A, 0x50, REG_2B, 0x50,
+				     REG_2C, 0x4D, REG_2D, 0x03, REG_2E, 0x06,
+				     REG_2F, 0x06, REG_30, 0x10, REG_31, 0x02,
+				     REG_32, 0x14, REG_33, 0x34, REG_34, 0x01,
+				     REG_35, 0x08, REG_36, 0x03, REG_37, 0x21))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_CALIB:
+			/* Tuning takes most of the initialization time, skip it
+			 * if the values of the previous session are still
+			 * valid. */
+			if (calibration_load(dev, &t->reg_dc)) {
+				dev->step = OPEN_DC;
+				continue;
+			}
+			/* The values are checked in the order of the tuning,
+			 * which sets again all the registers modified by the
+			 * checks if one fails. */
+			dev->step = OPEN_CALIB_FRAME;
+			if (seq_write_regs(dev, 2, REG_DCOFFSET, dev->dcoffset))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_CALIB_FRAME:
+			/* As in the DCoffset tuning, the frame must still be
+			 * almost black with the tuned DCoffset. Otherwise the
+			 * sensor has changed and must be tuned again. */
+			seq_get_frame(dev, dev->gain, 0x15, 0x10);
+			dev->step = OPEN_CALIB_ANS;
+			return SEQ_REQUEST;
+
+		case OPEN_CALIB_ANS:
+			if (!process_frame_empty(dev->buf, FRAME_SIZE, 0)) {
+				fp_dbg("calibration cache does not match the sensor");
+				dev->step = OPEN_DC;
+				continue;
+			}
+			/* The check above only detects a black level which
+			 * went up. The tuning keeps one step above the first
+			 * black DCoffset, so the frame two steps below was not
+			 * black (unless it is DCOFFSET_MIN, never tested): if
+			 * it is now, the black level went down. */
+			if (dev->dcoffset - 2 <= DCOFFSET_MIN) {
+				dev->step = OPEN_CALIB_DTVRT;
+				continue;
+			}
+			dev->step = OPEN_CALIB_LOW_FRAME;
+			if (seq_write_regs(dev, 2, REG_DCOFFSET, dev->dcoffset - 2))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_CALIB_LOW_FRAME:
+			seq_get_frame(dev, dev->gain, 0x15, 0x10);
+			dev->step = OPEN_CALIB_LOW_ANS;
+			return SEQ_REQUEST;
+
+		case OPEN_CALIB_LOW_ANS:
+			if (process_frame_empty(dev->buf, FRAME_SIZE, 0)) {
+				fp_dbg("calibration cache does not match the sensor");
+				dev->step = OPEN_DC;
+				continue;
+			}
+			dev->step = OPEN_CALIB_DTVRT;
+			continue;
+
+		case OPEN_CALIB_DTVRT:
+			/* The DTVRT tuning checks the cached values instead of
+			 * searching them (see OPEN_DTVRT_ANS), with the
+			 * registers as set at the end of the DCoffset tuning.
+			 * It goes on with OPEN_CALIB_VRB. */
+			t->check = 1;
+			t->check_failed = 0;
+			dev->step = OPEN_DTVRT;
+			if (seq_write_regs(dev, 8, REG_21, 0x23, REG_22, 0x21,
+				     REG_GAIN, dev->gain, REG_DCOFFSET, dev->dcoffset))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_CALIB_VRB:
+			/* As in the VRT/VRB tuning, the frame must still be
+			 * balanced. */
+			dev->step = OPEN_CALIB_VRB_FRAME;
+			if (seq_write_regs(dev, 2, REG_DCOFFSET, t->reg_dc - 1))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_CALIB_VRB_FRAME:
+			seq_get_frame(dev, dev->gain, dev->vrt, dev->vrb);
+			dev->step = OPEN_CALIB_VRB_ANS;
+			return SEQ_REQUEST;
+
+		case OPEN_CALIB_VRB_ANS:
+			if (!tune_frame_balanced(dev->buf, &dark, &bright)
+			    || dark > 0.95 || bright > 0.95) {
+				fp_dbg("calibration cache does not match the sensor");
+				dev->step = OPEN_DC;
+				continue;
+			}
+			dev->step = OPEN_CALIB_OK;
+			continue;
+
+		case OPEN_CALIB_OK:
+			fp_dbg("-> DCoffset=0x%02X Gain=0x%02X DTVRT=0x%02X "
+			       "DCoffset(contact)=0x%02X VRT=0x%02X VRB=0x%02X "
+			       "(from cache)", dev->dcoffset, dev->gain,
+			       dev->dtvrt, dev->dcoffset_ct, dev->vrt, dev->vrb);
+			/* Registers as set at the end of the tuning. */
+			dev->step = OPEN_CONFIGURE;
+			if (seq_write_regs(dev, 18, REG_21, 0x23, REG_22, 0x21,
+				     REG_DCOFFSET, t->reg_dc, REG_DTVRT, dev->dtvrt,
+				     REG_26, 0x11, REG_27, 0x00,
+				     REG_GAIN, dev->gain, REG_VRT, dev->vrt,
+				     REG_VRB, dev->vrb))
+				return SEQ_REQUEST;
+			continue;
+
+		/* Tune the DCoffset value and adjust the gain value if
+		 * required. */
+		case OPEN_DC:
+			fp_dbg("Tuning DCoffset");
+			/* TODO To get better results, tuning must be done 3
+			 * times as in captured traffic to make sure that the
+			 * value is correct. */
+			/* The default gain should work but it may reach a
+			 * DCOffset limit so in this case we decrease the
+			 * gain. */
+			t->check = 0;
+			t->gain = GAIN_SMALL_INIT;
+			t->min = DCOFFSET_MIN;
+			t->max = DCOFFSET_MAX;
+			dev->step = OPEN_DC_SET;
+			continue;
+
+		case OPEN_DC_SET:
+			/* Dichotomic search to find at which value the frame
+			 * becomes almost black. */
+			if (t->min + 1 >= t->max) {
+				if (t->max < DCOFFSET_MAX) {
+					t->dcoffset = t->max + 1;
+					dev->step = OPEN_DC_END;
+					continue;
+				}
+				t->gain--;
+				t->min = DCOFFSET_MIN;
+				t->max = DCOFFSET_MAX;
+			}
+			t->dcoffset = (t->max + t->min) / 2;
+			fp_dbg("Testing DCoffset=0x%02X Gain=0x%02X", t->dcoffset,
+			       t->gain);
+			dev->step = OPEN_DC_FRAME;
+			if (seq_write_regs(dev, 2, REG_DCOFFSET, t->dcoffset))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DC_FRAME:
+			/* vrt:0x15 vrb:0x10 are constant in all tuning frames. */
+			seq_get_frame(dev, t->gain, 0x15, 0x10);
+			dev->step = OPEN_DC_ANS;
+			return SEQ_REQUEST;
+
+		case OPEN_DC_ANS:
+			if (process_frame_empty(dev->buf, FRAME_SIZE, 0))
+				t->max = t->dcoffset;
+			else
+				t->min = t->dcoffset;
+			dev->step = OPEN_DC_SET;
+			continue;
+
+		case OPEN_DC_END:
+			fp_dbg("-> DCoffset=0x%02X Gain=0x%02X", t->dcoffset, t->gain);
+			dev->gain = t->gain;
+			dev->dcoffset = t->dcoffset;
+			/* ??? how reg21 / reg22 are calculated */
+			/* In captured traffic, read REG_GAIN, REG_VRT, and
+			 * REG_VRB registers. */
+			dev->step = OPEN_DTVRT;
+			if (seq_write_regs(dev, 8, REG_21, 0x23, REG_22, 0x21,
+				     REG_GAIN, t->gain, REG_DCOFFSET, t->dcoffset))
+				return SEQ_REQUEST;
+			continue;
+
+		/* Tune the value for DTVRT and adjust DCOFFSET if needed. */
+		case OPEN_DTVRT:
+			assert(dev->dcoffset);
+			/* Save registers to reset it at the end. */
+			dev->step = OPEN_DTVRT_SAVE50;
+			if (seq_read_regs(dev, 1, REG_VCO_CONTROL))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DTVRT_SAVE50:
+			dev->step = OPEN_DTVRT_SAVE59;
+			if (seq_read_regs(dev, 2, REG_50, REG_51))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DTVRT_SAVE59:
+			dev->step = OPEN_DTVRT_START;
+			if (seq_read_regs(dev, 3, REG_59, REG_5A, REG_5B))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DTVRT_START:
+			t->reg_e5 = dev->regs[REG_VCO_CONTROL];
+			t->reg_50 = dev->regs[REG_50];
+			t->reg_51 = dev->regs[REG_51];
+			t->reg_59 = dev->regs[REG_59];
+			t->reg_5a = dev->regs[REG_5A];
+			t->reg_5b = dev->regs[REG_5B];
+			/* Use DCOffset for frame capture as default. */
+			t->dcoffset_ct = t->check ? dev->dcoffset_ct
+						  : dev->dcoffset;
+			dev->step = OPEN_DTVRT_RESTART;
+			continue;
+
+		case OPEN_DTVRT_RESTART:
+			dev->step = OPEN_DTVRT_CONTACT;
+			if (seq_write_regs(dev, 2, REG_MODE_CONTROL, REG_MODE_SLEEP))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DTVRT_CONTACT:
+			dev->step = OPEN_DTVRT_SET;
+			if (seq_write_regs(dev, 16, REG_DCOFFSET, t->dcoffset_ct,
+				     REG_VCO_CONTROL, REG_VCO_IDLE,
+				     REG_50, t->reg_50 | 0x80,
+				     REG_51, t->reg_51 & 0xF7, REG_59, 0x18,
+				     REG_5A, 0x08, REG_5B, 0x00,
+				     REG_MODE_CONTROL, REG_MODE_CONTACT))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DTVRT_SET:
+			if (t->check) {
+				fp_dbg("Checking DTVRT=0x%02X", dev->dtvrt);
+			} else {
+				fp_dbg("Tuning of DTVRT");
+			}
+			/* The tuned value is 5 above the first one detecting
+			 * the contact without finger. */
+			t->dtvrt = t->check ? dev->dtvrt - 5 : DTVRT_MAX;
+			dev->step = OPEN_DTVRT_DETECT;
+			if (seq_write_regs(dev, 2, REG_DTVRT, t->dtvrt))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DTVRT_DETECT:
+			/* REG_03 is never in the shadow copy. */
+			seq_read_regs(dev, 1, REG_03);
+			dev->step = OPEN_DTVRT_ANS;
+			return SEQ_REQUEST;
+
+		case OPEN_DTVRT_ANS:
+			/* 83,A3:no 93,B3:yes */
+			contact = (ans->sige_readreg.regs[0] >> 4) & 0x1;
+			if (t->check) {
+				/* The contact must be detected 5 below the
+				 * cached value and not at this value (unless
+				 * it is above DTVRT_MAX, never tested). */
+				if (contact != (t->dtvrt < dev->dtvrt)) {
+					fp_dbg("calibration cache does not "
+					       "match the sensor");
+					t->check_failed = 1;
+				} else if (t->dtvrt < dev->dtvrt
+					   && dev->dtvrt <= DTVRT_MAX) {
+					t->dtvrt = dev->dtvrt;
+					dev->step = OPEN_DTVRT_DETECT;
+					if (seq_write_regs(dev, 2, REG_DTVRT,
+							   t->dtvrt))
+						return SEQ_REQUEST;
+					continue;
+				}
+				dev->step = OPEN_DTVRT_END;
+				continue;
+			}
+			/* Arbitrary lowest value for DCOffset. */
+			if (contact || t->dcoffset_ct <= 0x10) {
+				dev->step = OPEN_DTVRT_END;
+				continue;
+			}
+			if (t->dtvrt <= 5) {
+				/* Decrease DCoffset if cannot adjust a value for
+				 * DTVRT. */
+				t->dcoffset_ct--;
+				fp_dbg("Decrease DCoffset=0x%02X for contact "
+				       "detection (DTVRT)", t->dcoffset_ct);
+				dev->step = OPEN_DTVRT_RESTART;
+				continue;
+			}
+			t->dtvrt -= 5;
+			fp_dbg("Testing DTVRT=0x%02X DCoffset=0x%02X", t->dtvrt,
+			       t->dcoffset_ct);
+			dev->step = OPEN_DTVRT_DETECT;
+			if (seq_write_regs(dev, 2, REG_DTVRT, t->dtvrt))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DTVRT_END:
+			if (t->check) {
+				t->dtvrt = dev->dtvrt;
+			} else {
+				t->dtvrt += 5;
+				fp_dbg("-> DTVRT=0x%02X DCoffset=0x%02X",
+				       t->dtvrt, t->dcoffset_ct);
+				dev->dtvrt = t->dtvrt;
+				dev->dcoffset_ct = t->dcoffset_ct;
+			}
+			dev->step = OPEN_DTVRT_RESET;
+			if (seq_write_regs(dev, 2, REG_MODE_CONTROL, REG_MODE_SLEEP))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DTVRT_RESET:
+			/* Reset registers value from initial values, DCOffset
+			 * for frame capturing and set value found for DTVRT. */
+			if (!t->check)
+				dev->step = OPEN_VRB;
+			else if (t->check_failed)
+				dev->step = OPEN_DC;
+			else
+				dev->step = OPEN_CALIB_VRB;
+			if (seq_write_regs(dev, 16, REG_VCO_CONTROL, t->reg_e5,
+				     REG_50, t->reg_50, REG_51, t->reg_51,
+				     REG_59, t->reg_59, REG_5A, t->reg_5a,
+				     REG_5B, t->reg_5b, REG_DCOFFSET, dev->dcoffset,
+				     REG_DTVRT, t->dtvrt))
+				return SEQ_REQUEST;
+			continue;
+
+		/* Tune value of VRT and VRB for contrast and brightness. */
+		case OPEN_VRB:
+			fp_dbg("Tuning of VRT/VRB");
+			dev->step = OPEN_VRB_START;
+			if (seq_read_regs(dev, 2, REG_GAIN, REG_DCOFFSET))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_VRB_START:
+			/* VRT(reg E1)=0x0A and VRB(reg E2)=0x10 are starting
+			 * values */
+			t->gain = dev->regs[REG_GAIN];
+			t->reg_dc = dev->regs[REG_DCOFFSET];
+			t->vrt = 0x0A;
+			t->vrb = 0x10;
+			/* Reduce DCoffset by 1 to allow tuning */
+			dev->step = OPEN_VRB_FRAME;
+			if (seq_write_regs(dev, 2, REG_DCOFFSET, t->reg_dc - 1))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_VRB_FRAME:
+			if (t->vrt >= VRT_MAX || t->vrb >= VRB_MAX) {
+				dev->step = OPEN_VRB_END;
+				continue;
+			}
+			fp_dbg("Testing VRT=0x%02X VRB=0x%02X", t->vrt, t->vrb);
+			seq_get_frame(dev, t->gain, t->vrt, t->vrb);
+			dev->step = OPEN_VRB_ANS;
+			return SEQ_REQUEST;
+
+		case OPEN_VRB_ANS:
+			/* Tuning VRT/VRB -> contrast and brightness */
+			dev->step = OPEN_VRB_FRAME;
+			if (tune_frame_balanced(dev->buf, &dark, &bright)) {
+				/* The image seems balanced. */
+				dev->step = OPEN_VRB_END;
+			} else {
+				if (t->vrt >= 2 * t->vrb - 0x0a) {
+					t->vrt++; t->vrb++;
+				} else {
+					t->vrt++;
+				}
+				/* Check maximum for vrt/vrb */
+				/* TODO if maximum is reached, leave with an
+				 * error? */
+				if (t->vrt > VRT_MAX)
+					t->vrt = VRT_MAX;
+				if (t->vrb > VRB_MAX)
+					t->vrb = VRB_MAX;
+			}
+			if (dark > 0.95) {
+				fp_dbg("Image is too dark, reducing DCoffset");
+				t->reg_dc--;
+			} else if (bright > 0.95) {
+				fp_dbg("Image is too bright, trying increase DCoffset");
+				t->reg_dc++;
+			} else {
+				continue;
+			}
+			if (seq_write_regs(dev, 2, REG_DCOFFSET, t->reg_dc - 1))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_VRB_END:
+			fp_dbg("-> VRT=0x%02X VRB=0x%02X", t->vrt, t->vrb);
+			dev->vrt = t->vrt;
+			dev->vrb = t->vrb;
+			/* Blocking file I/O in a transfer callback: a single
+			 * line written once after a full tuning, which is
+			 * small next to the tuning itself. */
+			calibration_save(dev, t->reg_dc);
+			/* Reset the DCOffset. In traces, REG_26/REG_27 are set.
+			 * purpose? values? Set Gain/VRT/VRB values found. */
+			/* In traces, Gain/VRT/VRB are read again. */
+			dev->step = OPEN_CONFIGURE;
+			if (seq_write_regs(dev, 12, REG_DCOFFSET, t->reg_dc,
+				     REG_26, 0x11, REG_27, 0x00, REG_GAIN, t->gain,
+				     REG_VRT, t->vrt, REG_VRB, t->vrb))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_CONFIGURE:
+			/* Configure fingerprint frame (set register value for
+			 * this session), see fp_configure. */
+			dev->step = OPEN_DONE;
+			if (seq_write_regs(dev, 2, REG_10, 0x92))
+				return SEQ_REQUEST;
+			continue;
+
+		case OPEN_DONE:
+			return SEQ_DONE;
+
+		default:
+			fp_err("Unknown open step %d", dev->step);
+			return -1;
+		}
+	}
 }
 
 /*
@@ -1007,7 +2537,8 @@ err:
 static int frame_capture(struct etes603_dev *dev, uint8_t *buf)
 {
 	/* Note that the length parameter can be changed but 0xC0 is the best value */
-	return dev_get_frame(dev->udev, FRAME_WIDTH, 0x00, 0x00, 0x00, 0x00, buf);
+	return dev_get_frame(dev->udev, dev->stats, FRAME_WIDTH, 0x00, 0x00,
+			     0x00, 0x00, buf);
 }
 
 /*
@@ -1019,16 +2550,17 @@ static int frame_prepare_capture(struct etes603_dev *dev)
 	if (set_mode_control(dev, REG_MODE_SLEEP))
 		return -1;
 	/* Set tuned realtime configuration. */
-	if (dev_set_regs(dev->udev, 2, REG_DCOFFSET, dev->dcoffset))
+	if (dev_queue_regs(dev, 2, REG_DCOFFSET, dev->dcoffset))
 		return -2;
-	if (dev_set_regs(dev->udev, 6, REG_GAIN, dev->gain, REG_VRT, dev->vrt, REG_VRB, dev->vrb))
+	if (dev_queue_regs(dev, 6, REG_GAIN, dev->gain, REG_VRT, dev->vrt, REG_VRB, dev->vrb))
 		return -3;
 	/* Set the sensor to realtime capturing (0x14). */
-	if (dev_set_regs(dev->udev, 2, REG_VCO_CONTROL, REG_VCO_RT))
+	if (dev_queue_regs(dev, 2, REG_VCO_CONTROL, REG_VCO_RT))
 		return -4;
 	/* REG_04 is frame configuration */
-	if (dev_set_regs(dev->udev, 2, REG_04, 0x00))
+	if (dev_queue_regs(dev, 2, REG_04, 0x00))
 		return -5;
+	/* Queued writes are sent with the mode change. */
 	if (set_mode_control(dev, REG_MODE_SENSOR))
 		return -6;
 	return 0;
@@ -1040,77 +2572,102 @@ static int frame_prepare_capture(struct etes603_dev *dev)
 static int fp_configure(struct etes603_dev *dev)
 {
 	/* REG_10 is required to get a good fingerprint frame (exact meaning?) */
-	return dev_set_regs(dev->udev, 2, REG_10, 0x92);
+	return dev_set_regs(dev, 2, REG_10, 0x92);
+}
+
+
+/*
+ * Free the transfers and buffers used by asynchronous functions.
+ */
+static void transfers_free(struct etes603_dev *dev)
+{
+	unsigned int i;
+	libusb_free_transfer(dev->req);
+	libusb_free_transfer(dev->ans);
+	free(dev->buf);
+	for (i = 0; i < CAPTURE_DEPTH_MAX; i++) {
+		libusb_free_transfer(dev->slots[i].req);
+		libusb_free_transfer(dev->slots[i].ans);
+	}
 }
 
+/*
+ * Make room for 'size' bytes from braw_cur in the raw buffer. It grows by
+ * BRAW_CHUNK bytes so a swipe is not limited, and it is kept for the next
+ * captures: it rarely grows after the first ones.
+ * Returns 0 on success.
+ */
+static int braw_grow(struct etes603_dev *dev, size_t size)
+{
+	size_t used = 0;
+	uint8_t *braw;
+
+	if (dev->braw != NULL) {
+		used = dev->braw_cur - dev->braw;
+		if (dev->braw_cur + size <= dev->braw_end)
+			return 0;
+	}
+	size = (used + size + BRAW_CHUNK - 1) / BRAW_CHUNK * BRAW_CHUNK;
+	if ((braw = realloc(dev->braw, size)) == NULL)
+		return -1;
+	dev->braw = braw;
+	dev->braw_cur = braw + used;
+	dev->braw_end = braw + size;
+	return 0;
+}
 
 /*
- * This function opens the sensor and initialize it.
+ * This function allocates the sensor structure and its buffers.
  * Returns NULL on error.
  */
 static struct etes603_dev *sensor_open(libusb_device_handle *udev)
 {
-	int ret;
+	unsigned int i;
 	struct etes603_dev *dev;
 
 	if ((dev = malloc(sizeof(struct etes603_dev))) == NULL) {
 		fp_err("cannot allocate memory");
 		return NULL;
 	}
+	memset(dev, 0, sizeof(struct etes603_dev));
+	kernels_init();
 
 	dev->udev = udev;
-	if ((dev->braw = malloc(FRAME_SIZE * 1000)) == NULL) {
+	/* Large enough for a fingerprint image, and for most of the swipes of
+	 * the assembled frames mode. */
+	if (braw_grow(dev, FRAMEFP_SIZE)) {
 		fp_err("cannot allocate memory");
 		goto err_free_dev;
 	}
-	dev->braw_end = dev->braw + (FRAME_SIZE * 1000);
-	dev->braw_cur = dev->braw;
-
-	if ((ret = check_info(dev)) != 0) {
-		fp_err("check_info failed (err=%d)", ret);
-		goto err_free_buffer;
-	}
-	if ((ret = get_cmd20(dev)) != 0) {
-		fp_err("get_cmd20 failed (err=%d)", ret);
-		goto err_free_buffer;
-	}
-	if ((ret = get_cmd25(dev)) != 0) {
-		fp_err("get_cmd25 failed (err=%d)", ret);
-		goto err_free_buffer;
-	}
-	if ((ret = init(dev)) != 0) {
-		fp_err("init failed (err=%d)", ret);
-		goto err_free_buffer;
-	}
-	if ((ret = init_enc(dev)) != 0) {
-		fp_err("init_enc failed (err=%d)", ret);
-		goto err_free_buffer;
-	}
-	if ((ret = init_regs(dev)) != 0) {
-		fp_err("init_regs failed (err=%d)", ret);
-		goto err_free_buffer;
-	}
-	if ((ret = tune_dc(dev)) != 0) {
-		fp_err("tune_dc failed (err=%d)", ret);
-		goto err_free_buffer;
-	}
-	if ((ret = tune_dtvrt(dev)) != 0) {
-		fp_err("tune_dtvrt failed (err=%d)", ret);
+	dev->new_line = -1;
+
+	/* Transfers and buffers of asynchronous functions are allocated once
+	 * so no allocation happens in callbacks. */
+	dev->req = libusb_alloc_transfer(0);
+	dev->ans = libusb_alloc_transfer(0);
+	if (dev->req == NULL || dev->ans == NULL) {
+		fp_err("cannot allocate transfers");
 		goto err_free_buffer;
 	}
-	if ((ret = tune_vrb(dev)) != 0) {
-		fp_err("tune_vrb failed (err=%d)", ret);
+	/* Fingerprint images are received directly in braw, the answer buffer
+	 * only holds messages and realtime frames. */
+	if ((dev->buf = malloc(FRAME_SIZE)) == NULL) {
+		fp_err("cannot allocate memory");
 		goto err_free_buffer;
 	}
-	/* Configure fingerprint frame (set register value for this session) */
-	if ((ret = fp_configure(dev)) != 0) {
-		fp_err("fp_configure failed (err=%d)", ret);
-		goto err_free_buffer;
+	for (i = 0; i < CAPTURE_DEPTH_MAX; i++) {
+		dev->slots[i].req = libusb_alloc_transfer(0);
+		dev->slots[i].ans = libusb_alloc_transfer(0);
+		if (dev->slots[i].req == NULL || dev->slots[i].ans == NULL) {
+			fp_err("cannot allocate transfers");
+			goto err_free_buffer;
+		}
 	}
 
 	return dev;
 
 err_free_buffer:
+	transfers_free(dev);
 	free(dev->braw);
 err_free_dev:
 	free(dev);
@@ -1118,13 +2675,27 @@ err_free_dev:
 }
 
 
+
+/*
+ * Return the delay before the next contact test. A finger is usually put on
+ * the sensor just after the activation so tests are frequent at first, then
+ * the delay increases while no finger is detected.
+ */
+static unsigned int contact_poll_delay(unsigned int delay, unsigned int elapsed)
+{
+	if (elapsed < CS_POLL_FAST)
+		return CS_POLL_MIN;
+	delay *= 2;
+	return delay > CS_POLL_MAX ? CS_POLL_MAX : delay;
+}
+
 /*
  * Detect the contact by reading register 0x03.
  */
 static int contact_detect(struct etes603_dev *dev)
 {
 	uint8_t reg_03;
-	if (dev_get_regs(dev->udev, 2, REG_03, &reg_03))
+	if (dev_get_regs(dev, 2, REG_03, &reg_03))
 		return -1;
 	/* 83,A3:no 93,B3:yes */
 	return (reg_03 >> 4) & 0x1;
@@ -1140,16 +2711,15 @@ static int contact_polling_init(struct etes603_dev *dev)
 	assert(dev->dcoffset_ct);
 	/* ? Check if always same values */
 	if (set_mode_control(dev, REG_MODE_SLEEP)
-	    || dev_set_regs(dev->udev, 2, REG_VCO_CONTROL, REG_VCO_IDLE)
-	    || dev_set_regs(dev->udev, 2, REG_59, 0x18)
-	    || dev_set_regs(dev->udev, 2, REG_5A, 0x08)
-	    || dev_set_regs(dev->udev, 2, REG_5B, 0x10))
+	    || dev_queue_regs(dev, 8, REG_VCO_CONTROL, REG_VCO_IDLE,
+			      REG_59, 0x18, REG_5A, 0x08, REG_5B, 0x10))
 		return -1;
 	if (set_mode_control(dev, REG_MODE_CONTACT)
-	    || dev_get_regs(dev->udev, 2, REG_50, &reg_50)
-	    || dev_set_regs(dev->udev, 2, REG_50, ((reg_50 & 0x7F) | 0x80)))
+	    || dev_get_regs(dev, 2, REG_50, &reg_50))
 		return -2;
-	if (dev_set_regs(dev->udev, 2, REG_DCOFFSET, dev->dcoffset_ct))
+	if (dev_queue_regs(dev, 4, REG_50, ((reg_50 & 0x7F) | 0x80),
+			   REG_DCOFFSET, dev->dcoffset_ct)
+	    || dev_flush_regs(dev))
 		return -3;
 	return 0;
 }
@@ -1161,7 +2731,7 @@ static int contact_polling_exit(struct etes603_dev *dev)
 {
 	/* Set VCO_CONTROL back to realtime mode */
 	if (set_mode_control(dev, REG_MODE_SLEEP)
-	    || dev_set_regs(dev->udev, 2, REG_VCO_CONTROL, REG_VCO_RT))
+	    || dev_set_regs(dev, 2, REG_VCO_CONTROL, REG_VCO_RT))
 		return -1;
 	return 0;
 }
@@ -1176,9 +2746,8 @@ static int contact_polling(struct etes603_dev *dev)
 	/* Contact polling power consumption is lower than capturing a lot of
 	 * frame. From website: Typical 15 mA @ USB2.0 imaging/navigating and
 	 * Typical <500uA finger detect mode. */
-	struct timeval endtime;
-	struct timeval curtime = {.tv_sec = CS_DETECT_TIMEOUT / 1000,
-				  .tv_usec = 0};
+	struct timespec start;
+	unsigned int delay = CS_POLL_MIN, elapsed;
 	int contact;
 
 	if (contact_polling_init(dev)) {
@@ -1187,28 +2756,26 @@ static int contact_polling(struct etes603_dev *dev)
 		goto end;
 	}
 
-	if (gettimeofday(&endtime, NULL)) {
-		fp_err("gettimeofday failed with %d", errno);
+	if (time_get(&start)) {
 		contact = -2;
 		goto end;
 	}
-	timeradd(&endtime, &curtime, &endtime);
 
-	do {
+	for (;;) {
 		contact = contact_detect(dev);
 		if (contact == 1) {
 			goto end;
 		}
 
-		/* 5 ms between each detect */
-		usleep(CS_DETECT_DELAY * 1000);
-
-		if (gettimeofday(&curtime, NULL)) {
-			fp_err("gettimeofday failed with %d", errno);
+		if (time_elapsed(&start, &elapsed)) {
 			contact = -2;
 			goto end;
 		}
-	} while (timercmp(&curtime, &endtime, <));
+		if (elapsed >= CS_DETECT_TIMEOUT)
+			break;
+		delay = contact_poll_delay(delay, elapsed);
+		usleep(delay * 1000);
+	}
 
 end:
 	contact_polling_exit(dev);
@@ -1216,6 +2783,140 @@ end:
 	return contact;
 }
 
+/* Steps of the contact detection sequence */
+#define CONTACT_INIT               1    /* See contact_polling_init */
+#define CONTACT_INIT_REGS          2
+#define CONTACT_INIT_50            3
+#define CONTACT_INIT_DC            4
+#define CONTACT_POLL_START         5
+#define CONTACT_POLL               6
+#define CONTACT_POLL_ANS           7
+#define CONTACT_EXIT               8    /* See contact_polling_exit */
+#define CONTACT_EXIT_VCO           9
+#define CONTACT_SENSOR             10   /* See frame_prepare_capture */
+#define CONTACT_SENSOR_REGS        11
+#define CONTACT_DONE               12
+
+/*
+ * Step of the contact detection sequence, the asynchronous version of
+ * contact_polling without timeout. The sensor waits in contact mode (low
+ * power) and switches to sensor mode only when a contact is detected. The
+ * sequence can start at CONTACT_SENSOR to only prepare the sensor mode.
+ * The sequence is stopped on deactivation, after leaving the contact mode as
+ * contact_polling_exit does.
+ */
+static int contact_step(struct etes603_dev *dev)
+{
+	struct egis_msg *ans = (struct egis_msg *)dev->buf;
+	unsigned int elapsed;
+
+	for (;;) {
+		if (dev->deactivating) {
+			if (dev->step > CONTACT_INIT && dev->step < CONTACT_EXIT)
+				dev->step = CONTACT_EXIT;
+			else if (dev->step != CONTACT_EXIT
+				 && dev->step != CONTACT_EXIT_VCO)
+				return -ECANCELED;
+		}
+		switch (dev->step) {
+		case CONTACT_INIT:
+			assert(dev->dcoffset_ct);
+			dev->step = CONTACT_INIT_REGS;
+			if (seq_write_regs(dev, 2, REG_MODE_CONTROL, REG_MODE_SLEEP))
+				return SEQ_REQUEST;
+			continue;
+
+		case CONTACT_INIT_REGS:
+			/* ? Check if always same values */
+			dev->step = CONTACT_INIT_50;
+			if (seq_write_regs(dev, 10, REG_VCO_CONTROL, REG_VCO_IDLE,
+				     REG_59, 0x18, REG_5A, 0x08, REG_5B, 0x10,
+				     REG_MODE_CONTROL, REG_MODE_CONTACT))
+				return SEQ_REQUEST;
+			continue;
+
+		case CONTACT_INIT_50:
+			dev->step = CONTACT_INIT_DC;
+			if (seq_read_regs(dev, 1, REG_50))
+				return SEQ_REQUEST;
+			continue;
+
+		case CONTACT_INIT_DC:
+			dev->step = CONTACT_POLL_START;
+			if (seq_write_regs(dev, 4,
+				     REG_50, (dev->regs[REG_50] & 0x7F) | 0x80,
+				     REG_DCOFFSET, dev->dcoffset_ct))
+				return SEQ_REQUEST;
+			continue;
+
+		case CONTACT_POLL_START:
+			if (time_get(&dev->poll_start))
+				return -1;
+			dev->delay = CS_POLL_MIN;
+			dev->step = CONTACT_POLL;
+			continue;
+
+		case CONTACT_POLL:
+			/* REG_03 is never in the shadow copy. */
+			seq_read_regs(dev, 1, REG_03);
+			dev->step = CONTACT_POLL_ANS;
+			return SEQ_REQUEST;
+
+		case CONTACT_POLL_ANS:
+			/* 83,A3:no 93,B3:yes */
+			if ((ans->sige_readreg.regs[0] >> 4) & 0x1) {
+				fp_dbg("Contact detected");
+				dev->step = CONTACT_EXIT;
+				continue;
+			}
+			if (time_elapsed(&dev->poll_start, &elapsed))
+				return -1;
+			dev->delay = contact_poll_delay(dev->delay, elapsed);
+			dev->step = CONTACT_POLL;
+			return SEQ_WAIT;
+
+		case CONTACT_EXIT:
+			/* Set VCO_CONTROL back to realtime mode */
+			dev->step = CONTACT_EXIT_VCO;
+			if (seq_write_regs(dev, 2, REG_MODE_CONTROL, REG_MODE_SLEEP))
+				return SEQ_REQUEST;
+			continue;
+
+		case CONTACT_EXIT_VCO:
+			dev->step = CONTACT_SENSOR;
+			if (seq_write_regs(dev, 2, REG_VCO_CONTROL, REG_VCO_RT))
+				return SEQ_REQUEST;
+			continue;
+
+		case CONTACT_SENSOR:
+			assert(dev->dcoffset && dev->gain && dev->vrt && dev->vrb);
+			dev->step = CONTACT_SENSOR_REGS;
+			if (seq_write_regs(dev, 2, REG_MODE_CONTROL, REG_MODE_SLEEP))
+				return SEQ_REQUEST;
+			continue;
+
+		case CONTACT_SENSOR_REGS:
+			/* Set tuned realtime configuration and the sensor to
+			 * realtime capturing. */
+			dev->step = CONTACT_DONE;
+			if (seq_write_regs(dev, 14, REG_DCOFFSET, dev->dcoffset,
+				     REG_GAIN, dev->gain, REG_VRT, dev->vrt,
+				     REG_VRB, dev->vrb,
+				     REG_VCO_CONTROL, REG_VCO_RT, REG_04, 0x00,
+				     REG_MODE_CONTROL, REG_MODE_SENSOR))
+				return SEQ_REQUEST;
+			continue;
+
+		case CONTACT_DONE:
+			return SEQ_DONE;
+
+		default:
+			fp_err("Unknown contact step %d", dev->step);
+			return -1;
+		}
+	}
+}
+
 /*
  * Ask the sensor for a fingerprint frame.
  */
@@ -1231,14 +2932,14 @@ static int fp_capture(struct etes603_dev *dev, uint8_t *buf, size_t bufsize)
 	if (set_mode_control(dev, REG_MODE_FP))
 		return -3;
 
-	if (dev_get_fp(dev->udev, buf))
+	if (dev_get_fp(dev->udev, dev->stats, buf))
 		return -4;
 
 	if (set_mode_control(dev, REG_MODE_SLEEP))
 		return -5;
 
 	/* Set VCO_CONTROL to realtime mode (maybe not needed) */
-	if (dev_set_regs(dev->udev, 2, REG_VCO_CONTROL, REG_VCO_RT))
+	if (dev_set_regs(dev, 2, REG_VCO_CONTROL, REG_VCO_RT))
 		return -6;
 
 	return 0;
@@ -1252,8 +2953,10 @@ __attribute__((used))
 static int fp_capture_asm(struct etes603_dev *dev, uint8_t *braw, size_t bsize)
 {
 	uint8_t bframe[FRAME_SIZE];
+	struct frame_desc fd;
 	uint8_t *braw_cur = braw;
 	uint8_t *braw_end = braw + bsize;
+	int new_line = -1;
 
 	if (frame_prepare_capture(dev))
 		goto err;
@@ -1265,15 +2968,17 @@ static int fp_capture_asm(struct etes603_dev *dev, uint8_t *braw, size_t bsize)
 	do {
 		if (frame_capture(dev, bframe))
 			goto err;
-	} while (process_frame_empty(bframe, FRAME_SIZE, 1));
+		process_frame_describe(&fd, bframe);
+	} while (process_frame_desc_empty(&fd, 1));
 
 	/* While is not aborted and the frame is not empty and that the buffer
 	 * is not full, retrieve and process frame. */
 	do {
-		braw_cur = process_frame(braw_cur, bframe);
+		braw_cur = process_frame_predict(braw_cur, &fd, &new_line);
 		if (frame_capture(dev, bframe))
 			goto err;
-	} while (!process_frame_empty(bframe, FRAME_SIZE, 1)
+		process_frame_describe(&fd, bframe);
+	} while (!process_frame_desc_empty(&fd, 1)
 		 && (braw_cur + FRAME_SIZE) < braw_end);
 
 	/* Set the sensor in sleep mode (needed?) */
@@ -1302,20 +3007,26 @@ static int sensor_detect_finger(struct etes603_dev *dev)
 	return ret;
 }
 
+/* Registers set when the sensor is closed (values from a captured frame) */
+#define CLOSE_REGS \
+	REG_DCOFFSET, 0x31, REG_GAIN, 0x23, \
+	REG_DTVRT, 0x0D, REG_51, 0x30, REG_VCO_CONTROL, REG_VCO_IDLE, REG_F0, 0x01, \
+	REG_F2, 0x4E, REG_50, 0x8F, REG_59, 0x18, REG_5A, 0x08, REG_5B, 0x10, \
+	REG_MODE_CONTROL, REG_MODE_CONTACT
+
 /*
  * Close the sensor by setting some registers.
  */
 static int sensor_close(struct etes603_dev *dev, libusb_device_handle *udev)
 {
-	if (udev) {
-		/* Values from a captured frame */
-		dev_set_regs(udev, 24, REG_DCOFFSET, 0x31, REG_GAIN, 0x23,
-			REG_DTVRT, 0x0D, REG_51, 0x30, REG_VCO_CONTROL, REG_VCO_IDLE, REG_F0, 0x01,
-			REG_F2, 0x4E, REG_50, 0x8F, REG_59, 0x18, REG_5A, 0x08, REG_5B, 0x10,
-			REG_MODE_CONTROL, REG_MODE_CONTACT);
-	}
+	if (udev)
+		sync_set_regs(udev, 24, CLOSE_REGS);
 
 	if (dev) {
+		if (getenv("ETES603_STATS") != NULL)
+			dev_dump_stats(dev, stderr);
+		trace_flush();
+		transfers_free(dev);
 		free(dev->braw);
 		free(dev);
 	}
@@ -1327,209 +3038,1356 @@ static int sensor_close(struct etes603_dev *dev, libusb_device_handle *udev)
 /* Processing functions */
 
 /*
- * Return the brightness of a frame
+ * Frame kernels
+ *
+ * Pixels are packed by 2 in a byte (4 bits each). The loops over whole frames
+ * have SIMD versions for x86 (SSE2, AVX2) and ARM (NEON), chosen once by
+ * kernels_init from the features of the CPU. They give the same results as
+ * the scalar versions, which ETES603_SIMD=0 selects.
  */
-static unsigned int process_get_brightness(uint8_t *f, size_t s)
+
+struct frame_kernels {
+	const char *name;
+	/* Sum of the pixels of 's' bytes */
+	unsigned int (*brightness)(const uint8_t *f, size_t s);
+	/* 'n' bytes to 2 * 'n' pixels of 8 bits, the high nibble first. The
+	 * pixels are inverted (255 - pixel, as FP_IMG_COLORS_INVERTED) if
+	 * 'invert' */
+	void (*expand8)(const uint8_t *in, size_t n, uint8_t *out, int invert);
+	/* Same to gray pixels of 32 bits (0x00RRGGBB), the low nibble first if
+	 * 'low_first' */
+	void (*expand32)(const uint8_t *in, size_t n, uint32_t *out,
+		int low_first);
+	/* Sum of the absolute differences of the pixels of a row of a realtime
+	 * frame (FRAME_WIDTH / 2 bytes) */
+	unsigned int (*sad_row)(const uint8_t *a, const uint8_t *b);
+	/* Average of the pixels of a row of 'dst' and 'src' into 'dst'
+	 * (rounded down) */
+	void (*merge_row)(uint8_t *dst, const uint8_t *src);
+};
+
+/*
+ * Row kernels of the set 'set' (see struct frame_kernels). The generic kernels
+ * are inlined (flatten) with a constant size: the loops have a fixed number of
+ * iterations and no tail, which the compiler can unroll or vectorize. 'target'
+ * is the target attribute of the set.
+ */
+#define FRAME_ROW_KERNELS(set, target)					\
+target __attribute__((flatten))						\
+static unsigned int sad_row_##set(const uint8_t *a, const uint8_t *b)	\
+{									\
+	return sad_##set(a, b, FRAME_WIDTH / 2);			\
+}									\
+target __attribute__((flatten))						\
+static void merge_row_##set(uint8_t *dst, const uint8_t *src)		\
+{									\
+	merge_##set(dst, src, FRAME_WIDTH / 2);				\
+}
+
+#define FRAME_KERNELS_ROW_INIT(set)					\
+	.sad_row = sad_row_##set,					\
+	.merge_row = merge_row_##set
+
+static unsigned int brightness_scalar(const uint8_t *f, size_t s)
 {
 	unsigned int i, sum = 0;
 	for (i = 0; i < s; i++) {
 		sum += f[i] & 0x0F;
 		sum += f[i] >> 4;
 	}
-	return sum;
+	return sum;
+}
+
+static unsigned int sad_scalar(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	unsigned int j, sum = 0;
+	int v;
+	for (j = 0; j < n; j++) {
+		v = (int)(a[j] & 0x0F) - (int)(b[j] & 0x0F);
+		sum += v >= 0 ? v : -v;
+		v = (int)(a[j] >> 4) - (int)(b[j] >> 4);
+		sum += v >= 0 ? v : -v;
+	}
+	return sum;
+}
+
+static void merge_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+	uint8_t pxl, pxh;
+	for (i = 0; i < n; i++) {
+		pxl = ((dst[i] & 0x0F) + (src[i] & 0x0F)) >> 1;
+		pxh = ((dst[i] >> 4) + (src[i] >> 4)) >> 1;
+		dst[i] = pxl | (pxh << 4);
+	}
+}
+
+static void expand8_scalar(const uint8_t *in, size_t n, uint8_t *out,
+	int invert)
+{
+	/* 255 - pixel is pixel ^ 0xFF */
+	const uint8_t x = invert ? 0xFF : 0x00;
+	size_t i, j = 0;
+	for (i = 0; i < n; i++, j += 2) {
+		/* 16 gray levels transform to 256 levels using << 4 */
+		out[j] = (in[i] & 0xF0) ^ x;
+		out[j+1] = (uint8_t)(in[i] << 4) ^ x;
+	}
+}
+
+static void expand32_scalar(const uint8_t *in, size_t n, uint32_t *out,
+	int low_first)
+{
+	size_t i, j = 0;
+	uint32_t dh, dl;
+	for (i = 0; i < n; i++, j += 2) {
+		dh = in[i] & 0xF0;
+		dl = (in[i] << 4) & 0xF0;
+		dh |= (dh << 8) | (dh << 16);
+		dl |= (dl << 8) | (dl << 16);
+		out[j] = low_first ? dl : dh;
+		out[j+1] = low_first ? dh : dl;
+	}
+}
+
+FRAME_ROW_KERNELS(scalar, )
+
+static const struct frame_kernels kernels_scalar = {
+	.name = "scalar",
+	.brightness = brightness_scalar,
+	.expand8 = expand8_scalar,
+	.expand32 = expand32_scalar,
+	FRAME_KERNELS_ROW_INIT(scalar),
+};
+
+#ifdef KERNELS_X86
+/* Both nibbles are added in bytes (at most 30), then PSADBW sums 8 bytes in
+ * each 64 bits lane. */
+__attribute__((target("sse2")))
+static unsigned int brightness_sse2(const uint8_t *f, size_t s)
+{
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, acc = zero;
+	size_t i;
+
+	for (i = 0; i + 16 <= s; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(f + i));
+		v = _mm_add_epi8(_mm_and_si128(v, mask),
+				 _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+	}
+	acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+	return _mm_cvtsi128_si32(acc) + brightness_scalar(f + i, s - i);
+}
+
+/* PSADBW gives the differences of the nibbles unpacked in bytes. */
+__attribute__((target("sse2")))
+static unsigned int sad_sse2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	__m128i va, vb, acc = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		va = _mm_loadu_si128((const __m128i *)(a + i));
+		vb = _mm_loadu_si128((const __m128i *)(b + i));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(va, mask),
+						      _mm_and_si128(vb, mask)));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(
+			_mm_and_si128(_mm_srli_epi16(va, 4), mask),
+			_mm_and_si128(_mm_srli_epi16(vb, 4), mask)));
+	}
+	acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+	return _mm_cvtsi128_si32(acc) + sad_scalar(a + i, b + i, n - i);
+}
+
+/* The sum of two nibbles fits in a byte, the shift of 16 bits lanes moves a
+ * bit of the next byte in bit 7 which is masked. */
+__attribute__((target("sse2")))
+static void merge_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	__m128i d, s, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		d = _mm_loadu_si128((const __m128i *)(dst + i));
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		lo = _mm_add_epi8(_mm_and_si128(d, mask), _mm_and_si128(s, mask));
+		hi = _mm_add_epi8(_mm_and_si128(_mm_srli_epi16(d, 4), mask),
+				  _mm_and_si128(_mm_srli_epi16(s, 4), mask));
+		lo = _mm_and_si128(_mm_srli_epi16(lo, 1), mask);
+		hi = _mm_and_si128(_mm_srli_epi16(hi, 1), mask);
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_or_si128(lo, _mm_slli_epi16(hi, 4)));
+	}
+	merge_scalar(dst + i, src + i, n - i);
+}
+
+/* Pixels of 16 bytes, in the order of the pixels */
+__attribute__((target("sse2")))
+static inline void expand_pixels_sse2(__m128i v, int low_first, __m128i *p0,
+	__m128i *p1)
+{
+	const __m128i mask = _mm_set1_epi8((char)0xF0);
+	__m128i hi = _mm_and_si128(v, mask);
+	__m128i lo = _mm_and_si128(_mm_slli_epi16(v, 4), mask);
+
+	if (low_first) {
+		*p0 = _mm_unpacklo_epi8(lo, hi);
+		*p1 = _mm_unpackhi_epi8(lo, hi);
+	} else {
+		*p0 = _mm_unpacklo_epi8(hi, lo);
+		*p1 = _mm_unpackhi_epi8(hi, lo);
+	}
+}
+
+__attribute__((target("sse2")))
+static void expand8_sse2(const uint8_t *in, size_t n, uint8_t *out,
+	int invert)
+{
+	const __m128i x = _mm_set1_epi8(invert ? (char)0xFF : 0);
+	__m128i p0, p1;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		expand_pixels_sse2(_mm_loadu_si128((const __m128i *)(in + i)),
+				   0, &p0, &p1);
+		_mm_storeu_si128((__m128i *)(out + 2 * i), _mm_xor_si128(p0, x));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 16),
+				 _mm_xor_si128(p1, x));
+	}
+	expand8_scalar(in + i, n - i, out + 2 * i, invert);
+}
+
+/* A gray pixel is the bytes p, p, p, 0: (p, p) and (p, 0) are unpacked to 16
+ * bits then together to 32 bits. */
+__attribute__((target("sse2")))
+static inline void store_gray_sse2(uint32_t *out, __m128i p)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i pp = _mm_unpacklo_epi8(p, p), p0 = _mm_unpacklo_epi8(p, zero);
+
+	_mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(pp, p0));
+	_mm_storeu_si128((__m128i *)(out + 4), _mm_unpackhi_epi16(pp, p0));
+	pp = _mm_unpackhi_epi8(p, p);
+	p0 = _mm_unpackhi_epi8(p, zero);
+	_mm_storeu_si128((__m128i *)(out + 8), _mm_unpacklo_epi16(pp, p0));
+	_mm_storeu_si128((__m128i *)(out + 12), _mm_unpackhi_epi16(pp, p0));
+}
+
+__attribute__((target("sse2")))
+static void expand32_sse2(const uint8_t *in, size_t n, uint32_t *out,
+	int low_first)
+{
+	__m128i p0, p1;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		expand_pixels_sse2(_mm_loadu_si128((const __m128i *)(in + i)),
+				   low_first, &p0, &p1);
+		store_gray_sse2(out + 2 * i, p0);
+		store_gray_sse2(out + 2 * i + 16, p1);
+	}
+	expand32_scalar(in + i, n - i, out + 2 * i, low_first);
+}
+
+FRAME_ROW_KERNELS(sse2, __attribute__((target("sse2"))))
+
+static const struct frame_kernels kernels_sse2 = {
+	.name = "sse2",
+	.brightness = brightness_sse2,
+	.expand8 = expand8_sse2,
+	.expand32 = expand32_sse2,
+	FRAME_KERNELS_ROW_INIT(sse2),
+};
+
+__attribute__((target("avx2")))
+static unsigned int brightness_avx2(const uint8_t *f, size_t s)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i v, acc = zero;
+	__m128i acc128;
+	size_t i;
+
+	for (i = 0; i + 32 <= s; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(f + i));
+		v = _mm256_add_epi8(_mm256_and_si256(v, mask),
+				_mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+	}
+	acc128 = _mm_add_epi64(_mm256_castsi256_si128(acc),
+			       _mm256_extracti128_si256(acc, 1));
+	acc128 = _mm_add_epi64(acc128, _mm_unpackhi_epi64(acc128, acc128));
+	return _mm_cvtsi128_si32(acc128) + brightness_scalar(f + i, s - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int sad_avx2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	__m256i va, vb, acc = _mm256_setzero_si256();
+	__m128i acc128;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		va = _mm256_loadu_si256((const __m256i *)(a + i));
+		vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+			_mm256_and_si256(va, mask), _mm256_and_si256(vb, mask)));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+			_mm256_and_si256(_mm256_srli_epi16(va, 4), mask),
+			_mm256_and_si256(_mm256_srli_epi16(vb, 4), mask)));
+	}
+	acc128 = _mm_add_epi64(_mm256_castsi256_si128(acc),
+			       _mm256_extracti128_si256(acc, 1));
+	acc128 = _mm_add_epi64(acc128, _mm_unpackhi_epi64(acc128, acc128));
+	/* GCC does not clear the upper halves before the SSE code (the tail
+	 * and the callers), which is slow on some CPUs. */
+	_mm256_zeroupper();
+	return _mm_cvtsi128_si32(acc128) + sad_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void merge_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	__m256i d, s, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		s = _mm256_loadu_si256((const __m256i *)(src + i));
+		lo = _mm256_add_epi8(_mm256_and_si256(d, mask),
+				     _mm256_and_si256(s, mask));
+		hi = _mm256_add_epi8(
+			_mm256_and_si256(_mm256_srli_epi16(d, 4), mask),
+			_mm256_and_si256(_mm256_srli_epi16(s, 4), mask));
+		lo = _mm256_and_si256(_mm256_srli_epi16(lo, 1), mask);
+		hi = _mm256_and_si256(_mm256_srli_epi16(hi, 1), mask);
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				    _mm256_or_si256(lo, _mm256_slli_epi16(hi, 4)));
+	}
+	_mm256_zeroupper();
+	merge_sse2(dst + i, src + i, n - i);
+}
+
+/* The unpacks work in 128 bits lanes, the lanes are put back in order. */
+__attribute__((target("avx2")))
+static void expand8_avx2(const uint8_t *in, size_t n, uint8_t *out,
+	int invert)
+{
+	const __m256i mask = _mm256_set1_epi8((char)0xF0);
+	const __m256i x = _mm256_set1_epi8(invert ? (char)0xFF : 0);
+	__m256i v, hi, lo, p0, p1;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(in + i));
+		hi = _mm256_xor_si256(_mm256_and_si256(v, mask), x);
+		lo = _mm256_xor_si256(
+			_mm256_and_si256(_mm256_slli_epi16(v, 4), mask), x);
+		p0 = _mm256_unpacklo_epi8(hi, lo);
+		p1 = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i *)(out + 2 * i),
+				    _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256((__m256i *)(out + 2 * i + 32),
+				    _mm256_permute2x128_si256(p0, p1, 0x31));
+	}
+	_mm256_zeroupper();
+	expand8_sse2(in + i, n - i, out + 2 * i, invert);
+}
+
+/* 8 pixels are widened to 32 bits, then multiplied to fill 3 bytes. */
+__attribute__((target("avx2")))
+static void expand32_avx2(const uint8_t *in, size_t n, uint32_t *out,
+	int low_first)
+{
+	const __m256i gray = _mm256_set1_epi32(0x010101);
+	__m128i p[2];
+	size_t i;
+	int k;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		expand_pixels_sse2(_mm_loadu_si128((const __m128i *)(in + i)),
+				   low_first, &p[0], &p[1]);
+		for (k = 0; k < 2; k++) {
+			_mm256_storeu_si256((__m256i *)(out + 2 * i + 16 * k),
+				_mm256_mullo_epi32(_mm256_cvtepu8_epi32(p[k]),
+						   gray));
+			_mm256_storeu_si256(
+				(__m256i *)(out + 2 * i + 16 * k + 8),
+				_mm256_mullo_epi32(_mm256_cvtepu8_epi32(
+					_mm_srli_si128(p[k], 8)), gray));
+		}
+	}
+	_mm256_zeroupper();
+	expand32_scalar(in + i, n - i, out + 2 * i, low_first);
+}
+
+FRAME_ROW_KERNELS(avx2, __attribute__((target("avx2"))))
+
+static const struct frame_kernels kernels_avx2 = {
+	.name = "avx2",
+	.brightness = brightness_avx2,
+	.expand8 = expand8_avx2,
+	.expand32 = expand32_avx2,
+	FRAME_KERNELS_ROW_INIT(avx2),
+};
+#endif
+
+#ifdef KERNELS_NEON
+static unsigned int brightness_neon(const uint8_t *f, size_t s)
+{
+	const uint8x16_t mask = vdupq_n_u8(0x0F);
+	uint32x4_t acc = vdupq_n_u32(0);
+	uint8x16_t v;
+	size_t i;
+
+	for (i = 0; i + 16 <= s; i += 16) {
+		v = vld1q_u8(f + i);
+		v = vaddq_u8(vandq_u8(v, mask), vshrq_n_u8(v, 4));
+		acc = vpadalq_u16(acc, vpaddlq_u8(v));
+	}
+	return vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1)
+	     + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3)
+	     + brightness_scalar(f + i, s - i);
+}
+
+static unsigned int sad_neon(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	const uint8x16_t mask = vdupq_n_u8(0x0F);
+	uint32x4_t acc = vdupq_n_u32(0);
+	uint8x16_t va, vb, v;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		va = vld1q_u8(a + i);
+		vb = vld1q_u8(b + i);
+		v = vaddq_u8(vabdq_u8(vandq_u8(va, mask), vandq_u8(vb, mask)),
+			     vabdq_u8(vshrq_n_u8(va, 4), vshrq_n_u8(vb, 4)));
+		acc = vpadalq_u16(acc, vpaddlq_u8(v));
+	}
+	return vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1)
+	     + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3)
+	     + sad_scalar(a + i, b + i, n - i);
+}
+
+/* VHADD is the average rounded down. */
+static void merge_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const uint8x16_t mask = vdupq_n_u8(0x0F);
+	uint8x16_t d, s, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		d = vld1q_u8(dst + i);
+		s = vld1q_u8(src + i);
+		lo = vhaddq_u8(vandq_u8(d, mask), vandq_u8(s, mask));
+		hi = vhaddq_u8(vshrq_n_u8(d, 4), vshrq_n_u8(s, 4));
+		vst1q_u8(dst + i, vorrq_u8(lo, vshlq_n_u8(hi, 4)));
+	}
+	merge_scalar(dst + i, src + i, n - i);
+}
+
+/* VST2 interleaves the high and low nibbles. */
+static void expand8_neon(const uint8_t *in, size_t n, uint8_t *out,
+	int invert)
+{
+	const uint8x16_t mask = vdupq_n_u8(0xF0);
+	const uint8x16_t x = vdupq_n_u8(invert ? 0xFF : 0x00);
+	uint8x16x2_t p;
+	uint8x16_t v;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = vld1q_u8(in + i);
+		p.val[0] = veorq_u8(vandq_u8(v, mask), x);
+		p.val[1] = veorq_u8(vshlq_n_u8(v, 4), x);
+		vst2q_u8(out + 2 * i, p);
+	}
+	expand8_scalar(in + i, n - i, out + 2 * i, invert);
+}
+
+/* VST4 writes the bytes p, p, p, 0 of each gray pixel. */
+static void expand32_neon(const uint8_t *in, size_t n, uint32_t *out,
+	int low_first)
+{
+	const uint8x16_t mask = vdupq_n_u8(0xF0);
+	uint8x16x2_t p;
+	uint8x16x4_t g;
+	uint8x16_t v, hi, lo;
+	size_t i;
+	int k;
+
+	g.val[3] = vdupq_n_u8(0);
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = vld1q_u8(in + i);
+		hi = vandq_u8(v, mask);
+		lo = vshlq_n_u8(v, 4);
+		p = low_first ? vzipq_u8(lo, hi) : vzipq_u8(hi, lo);
+		for (k = 0; k < 2; k++) {
+			g.val[0] = g.val[1] = g.val[2] = p.val[k];
+			vst4q_u8((uint8_t *)(out + 2 * i + 16 * k), g);
+		}
+	}
+	expand32_scalar(in + i, n - i, out + 2 * i, low_first);
+}
+
+FRAME_ROW_KERNELS(neon, )
+
+static const struct frame_kernels kernels_neon = {
+	.name = "neon",
+	.brightness = brightness_neon,
+	.expand8 = expand8_neon,
+	.expand32 = expand32_neon,
+	FRAME_KERNELS_ROW_INIT(neon),
+};
+#endif
+
+/* Kernels in use */
+static struct frame_kernels kernels = {
+	.name = "scalar",
+	.brightness = brightness_scalar,
+	.expand8 = expand8_scalar,
+	.expand32 = expand32_scalar,
+	FRAME_KERNELS_ROW_INIT(scalar),
+};
+
+/*
+ * Choose the kernels for the CPU, once.
+ */
+static void kernels_init(void)
+{
+	static int done = 0;
+	const char *simd;
+
+	if (done)
+		return;
+	done = 1;
+	kernels = kernels_scalar;
+	if ((simd = getenv("ETES603_SIMD")) != NULL && strcmp(simd, "0") == 0)
+		return;
+#if defined(KERNELS_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		kernels = kernels_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		kernels = kernels_sse2;
+#elif defined(KERNELS_NEON)
+	kernels = kernels_neon;
+#endif
+	fp_dbg("frame kernels: %s", kernels.name);
+}
+
+/*
+ * Return the brightness of a frame
+ */
+static unsigned int process_get_brightness(uint8_t *f, size_t s)
+{
+	return kernels.brightness(f, s);
+}
+
+/*
+ * Fill the descriptor of the frame 'raw' (FRAME_SIZE bytes), which must stay
+ * valid while the descriptor is used. The histogram is computed on demand.
+ */
+static void process_frame_describe(struct frame_desc *fd, uint8_t *raw)
+{
+	fd->raw = raw;
+	fd->brightness = process_get_brightness(raw, FRAME_SIZE);
+	fd->has_hist = 0;
+}
+
+/*
+ * Compute the histogram of the frame, once.
+ */
+static void process_frame_histogram(struct frame_desc *fd)
+{
+	static const unsigned int BW = 0x08; /* Border width*/
+	static const unsigned int FBW = FRAME_WIDTH / 2; /* Frame byte width */
+	unsigned int i, j;
+
+	if (fd->has_hist)
+		return;
+	memset(fd->hist, 0, sizeof(fd->hist));
+	/* fill up histogram using 4 rows of the frame */
+	for (j = 0; j < FRAME_HEIGHT; j++) {
+		/* only center pixels (0x50 pixels) */
+		for (i = BW + j * FBW; i < FBW - BW + j * FBW; i++)
+			fd->hist[fd->raw[i] >> 4]++;
+	}
+	fd->has_hist = 1;
+}
+
+/*
+ * Return true if 'sum', the brightness of 'size' bytes, is almost empty.
+ * If mode is 0, it is high sensibility for device tuning.
+ * Otherwise, for capture mode.
+ */
+static int process_empty(unsigned int sum, size_t size, int mode)
+{
+	/* Allow an average of 'threshold' luminosity per pixel */
+	if (mode) {
+		/* mode capture */
+		if (sum < size * 2)
+			return 1;
+	} else {
+		/* mode tuning */
+		if (sum < size)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Return true if the frame is almost empty (see process_empty).
+ */
+static int process_frame_empty(uint8_t *frame, size_t size, int mode)
+{
+	return process_empty(process_get_brightness(frame, size), size, mode);
+}
+
+static int process_frame_desc_empty(const struct frame_desc *fd, int mode)
+{
+	return process_empty(fd->brightness, FRAME_SIZE, mode);
+}
+
+/*
+ * Average error per pixel of an offset which compares 'lines' lines.
+ */
+static unsigned int process_dup_error(unsigned int sum, unsigned int bwidth,
+	unsigned int lines)
+{
+	/* note: we could use ^2 */
+	/* The usage of int makes value imprecise when divide. */
+	return sum * 127 / (bwidth * lines);
+}
+
+/*
+ * Compare lines in 'dst' and the frame 'src'.
+ * Return the number of new lines in 'src': the first offset with the lowest
+ * error, if it is below the threshold (else FRAME_HEIGHT).
+ * 'hint' is the expected result (-1 if none). It is compared first, then the
+ * other offsets line by line: as the error only grows, an offset is dropped as
+ * soon as it can not do better. The result does not depend on 'hint'.
+ */
+static int process_find_dup(uint8_t *dst, const struct frame_desc *fd,
+	int hint)
+{
+	static const unsigned int height = FRAME_HEIGHT;
+	/* Size in byte is width / 2 pixels per byte */
+	static const unsigned int bwidth = FRAME_WIDTH / 2;
+	const uint8_t *src = fd->raw;
+	unsigned int i, r;
+	/* Total errors when substract src from dst, by offset */
+	unsigned int sums[FRAME_HEIGHT];
+	/* Offsets still compared */
+	uint8_t alive[FRAME_HEIGHT];
+	unsigned int sum_error;
+	/* Number of lines that matches */
+	unsigned int nb = height;
+	/* Maximal error threshold to consider that lines match. */
+	/* Value 6 is empirical. */
+	unsigned int max_error = fd->brightness / 6;
+
+	/* Typical frame: 384 bytes / 196 px width / 4 bits value */
+	if (hint >= 0 && hint < FRAME_HEIGHT) {
+		for (r = 0, sum_error = 0; r + hint < height; r++)
+			sum_error += kernels.sad_row(dst + (r + hint) * bwidth,
+						     src + r * bwidth);
+		sum_error = process_dup_error(sum_error, bwidth, height - hint);
+		if (sum_error < max_error) {
+			max_error = sum_error;
+			nb = hint;
+		}
+	}
+	for (i = 0; i < height; i++) {
+		sums[i] = 0;
+		alive[i] = (int)i != hint;
+	}
+	/* Line r of 'src' is compared with line i + r of 'dst' */
+	for (r = 0; r < height; r++) {
+		for (i = 0; i + r < height; i++) {
+			if (!alive[i])
+				continue;
+			sums[i] += kernels.sad_row(dst + (i + r) * bwidth,
+						   src + r * bwidth);
+			sum_error = process_dup_error(sums[i], bwidth, height - i);
+			/* On a tie, the lower offset wins (but not the
+			 * threshold). */
+			if (sum_error > max_error || (sum_error == max_error
+			    && (nb == height || i > nb))) {
+				alive[i] = 0;
+			} else if (i + r == height - 1U) {
+				max_error = sum_error;
+				nb = i;
+			}
+		}
+	}
+	return nb;
+}
+
+/*
+ * The first 'merge' rows from src and dst are merged then raw copy.
+ */
+static void merge_and_append(uint8_t *dst, uint8_t *src, unsigned int merge)
+{
+	static const unsigned int bwidth = FRAME_WIDTH / 2;
+	unsigned int r;
+
+	assert(merge <= FRAME_HEIGHT);
+	for (r = 0; r < merge; r++)
+		kernels.merge_row(dst + r * bwidth, src + r * bwidth);
+	memcpy(dst + merge * bwidth, src + merge * bwidth,
+	       FRAME_SIZE - merge * bwidth);
+}
+
+
+
+/*
+ * Integrate the new frame 'src' into previous assembled frames 'dst'.
+ * 'dst' must point to the last buffer and have 384 bytes free at the end to append data.
+ * 'src' must describe the frame received (384 bytes).
+ * '*new_line' is the number of new lines of the previous frame (-1 for the
+ * first one), the finger moves slowly so it is tried first. It is set to the
+ * number of new lines of 'src'.
+ */
+static uint8_t *process_frame_predict(uint8_t *dst,
+	const struct frame_desc *src, int *new_line)
+{
+	/* TODO sweep direction to determine... merging will be different. */
+	*new_line = process_find_dup(dst, src, *new_line);
+	return process_frame_merge(dst, src->raw, *new_line);
+}
+
+/*
+ * Integrate the frame 'src' with 'new_line' new lines after the last frame
+ * 'dst' of the assembled frames. Return the new last frame.
+ */
+static uint8_t *process_frame_merge(uint8_t *dst, uint8_t *src,
+	unsigned int new_line)
+{
+	dst += (FRAME_WIDTH / 2) * new_line;
+	/* merge_and_append give a better result than just copying */
+	merge_and_append(dst, src, FRAME_HEIGHT - new_line);
+	/* memcpy(dst, src, FRAME_SIZE); */
+
+	return dst;
+}
+
+/*
+ * Same without prediction.
+ */
+__attribute__((used))
+static uint8_t *process_frame(uint8_t *dst, uint8_t *src)
+{
+	struct frame_desc fd;
+	int new_line = -1;
+
+	process_frame_describe(&fd, src);
+	return process_frame_predict(dst, &fd, &new_line);
+}
+
+/*
+ * Errors of the offsets of the frame 'src' after the frame 'dst': costs[i] is
+ * the error with i new lines, as in process_find_dup. FRAME_HEIGHT new lines
+ * (no match) costs the threshold, the offsets above it are not possible.
+ */
+static void process_frames_costs(const uint8_t *dst,
+	const struct frame_desc *src, unsigned int *costs)
+{
+	static const unsigned int bwidth = FRAME_WIDTH / 2;
+	unsigned int max_error = src->brightness / 6;
+	unsigned int i, r, sum;
+
+	for (i = 0; i < FRAME_HEIGHT; i++) {
+		for (r = 0, sum = 0; r + i < FRAME_HEIGHT; r++)
+			sum += kernels.sad_row(dst + (i + r) * bwidth,
+					       src->raw + r * bwidth);
+		costs[i] = process_dup_error(sum, bwidth, FRAME_HEIGHT - i);
+		if (costs[i] >= max_error)
+			costs[i] = UINT_MAX;
+	}
+	costs[FRAME_HEIGHT] = max_error;
+}
+
+/*
+ * Align a whole swipe: 'frames' holds 'n' frames received in order, the first
+ * one follows an empty frame. The number of new lines of each frame is chosen
+ * for the whole swipe (Viterbi): the sum of the errors of the frames plus a
+ * penalty for the jumps is minimal. The finger speed changes smoothly, so the
+ * offsets of two frames differ by one line at most (a fractional speed
+ * alternates between two offsets): each line more costs the threshold. A
+ * frame which matches several offsets follows its neighbours instead of
+ * taking the first one.
+ * Return 0 on success, 'new_lines' has the n offsets.
+ */
+static int process_frames_align(uint8_t *frames, unsigned int n,
+	uint8_t *new_lines)
+{
+	static const uint8_t empty[FRAME_SIZE];
+	/* Lowest total cost ending with each offset, for the current frame */
+	unsigned long long acc[FRAME_HEIGHT + 1], prev[FRAME_HEIGHT + 1], c;
+	unsigned int costs[FRAME_HEIGHT + 1];
+	/* Offset of the previous frame on the best path, by frame and offset */
+	uint8_t (*from)[FRAME_HEIGHT + 1];
+	struct frame_desc fd;
+	unsigned int k, i, j;
+
+	if (n == 0)
+		return 0;
+	if ((from = malloc(n * sizeof(*from))) == NULL)
+		return -1;
+	for (k = 0; k < n; k++) {
+		process_frame_describe(&fd, frames + k * FRAME_SIZE);
+		process_frames_costs(k ? frames + (k - 1) * FRAME_SIZE : empty,
+				     &fd, costs);
+		if (k > 0)
+			memcpy(prev, acc, sizeof(acc));
+		for (i = 0; i <= FRAME_HEIGHT; i++) {
+			acc[i] = ULLONG_MAX;
+			from[k][i] = 0;
+			if (costs[i] == UINT_MAX)
+				continue;
+			if (k == 0) {
+				acc[i] = costs[i];
+				continue;
+			}
+			for (j = 0; j <= FRAME_HEIGHT; j++) {
+				if (prev[j] == ULLONG_MAX)
+					continue;
+				c = prev[j] + costs[i];
+				if (i > j + 1 || j > i + 1)
+					c += (unsigned long long)costs[FRAME_HEIGHT]
+					   * ((i > j ? i - j : j - i) - 1);
+				if (c < acc[i]) {
+					acc[i] = c;
+					from[k][i] = j;
+				}
+			}
+		}
+	}
+	/* Backtrack from the best last offset */
+	for (i = 0, j = 1; j <= FRAME_HEIGHT; j++)
+		if (acc[j] < acc[i])
+			i = j;
+	for (k = n; k-- > 0;) {
+		new_lines[k] = i;
+		i = from[k][i];
+	}
+	free(from);
+	return 0;
+}
+
+/*
+ * Transform the 4 bits image 'input' of 'width' x 'height' pixels to a new
+ * image, in its final orientation in one pass: the rows are taken from the
+ * last one (the image is V flipped). The pixels are expanded to 8 bits and
+ * inverted (the image is white on black), as libfprint needs.
+ */
+static struct fp_img *process_transform_image(const uint8_t *input,
+	unsigned int width, unsigned int height)
+{
+	unsigned int bwidth = width / 2;
+	unsigned int r;
+	struct fp_img *img;
+
+	kernels_init();
+	img = fpi_img_new((size_t)bwidth * height * 2);
+	img->width = width;
+	img->height = height;
+	for (r = 0; r < height; r++)
+		kernels.expand8(input + (height - 1 - r) * bwidth, bwidth,
+				img->data + r * 2 * bwidth, 1);
+	img->flags = 0;
+	return img;
+}
+
+/*
+ * Transform 4 bits image to 32 bits gray pixels, for the display of the
+ * tools. The low nibble is the first pixel if 'low_first'.
+ */
+__attribute__((used))
+static void process_transform4_to_32(uint8_t *input, unsigned int input_size,
+	uint32_t *output, int low_first)
+{
+	kernels_init();
+	kernels.expand32(input, input_size, output, low_first);
+}
+
+
+/* libfprint stuff */
+
+/*
+ * Called when the deactivation was requested.
+ */
+static void complete_deactivation(struct fp_img_dev *idev)
+{
+	struct etes603_dev *dev = idev->priv;
+
+	/* TODO I guess I should not completely deinit the sensor? */
+	/* TODO Change at least to SLEEP_MODE ? */
+	dev->deactivating = FALSE;
+	fpi_imgdev_deactivate_complete(idev);
+}
+
+/*
+ * Transforms the raw data to fprint data and submit it to fprint.
+ */
+static int transform_to_fpi(struct fp_img_dev *idev)
+{
+	struct fp_img *img;
+	struct etes603_dev *dev = idev->priv;
+	unsigned int size;
+
+	if (dev->mode == 1) {
+		/* Assembled frames */
+		/* braw_cur points to the last frame so needs to adjust to end */
+		size = dev->braw_cur + FRAME_SIZE - dev->braw;
+		/* es603 has 2 pixels per byte. */
+		/* img->width could be set 256 always but need a new function to handle this */
+		img = process_transform_image(dev->braw, FRAME_WIDTH,
+					      size * 2 / FRAME_WIDTH);
+	} else {
+		/* FingerPrint Frame */
+		/* img->width can only be changed when -1 was set at init */
+		img = process_transform_image(dev->braw, FRAMEFP_WIDTH,
+					      FRAMEFP_HEIGHT);
+	}
+	/* Images received are white on black, so they are inverted
+	 * (FP_IMG_COLORS_INVERTED) and flipped (FP_IMG_V_FLIPPED) by
+	 * process_transform_image. */
+	/* TODO for different sweep direction ? FP_IMG_H_FLIPPED */
+	/* Send image to fpi */
+	fpi_imgdev_image_captured(idev, img);
+	/* Indicate that the finger is removed. */
+	fpi_imgdev_report_finger_status(idev, FALSE);
+
+	return 0;
+}
+
+/* state for asynchronous functions */
+#define STATE_INIT                     1
+#define STATE_FINGER_REQ_SEND          2
+#define STATE_FINGER_REQ_RECV          3
+#define STATE_FINGER_ANS               4
+#define STATE_CAPTURING                5
+#define STATE_CAPTURING_END            6
+#define STATE_INIT_FP_REQ_SEND         7
+#define STATE_INIT_FP_REQ_RECV         8
+#define STATE_INIT_FP_ANS              9
+#define STATE_CAPTURING_FP_REQ_SEND    10
+#define STATE_CAPTURING_FP_REQ_RECV    11
+#define STATE_CAPTURING_FP_ANS         12
+#define STATE_DEACTIVATING             13
+#define STATE_CONTACT                  14
+
+static int async_transfer(struct fp_img_dev *dev, unsigned char ep,
+		unsigned char *msg_data, unsigned int msg_size);
+static void async_transfer_cb(struct libusb_transfer *transfer);
+static void seq_timeout(void *data);
+static void seq_start(struct fp_img_dev *idev, int (*step)(struct etes603_dev *),
+	unsigned int first, void (*done)(struct fp_img_dev *, int));
+static void capture_cb(struct libusb_transfer *transfer);
+static void capture_process(struct fp_img_dev *idev);
+
+/*
+ * Submit the frame request of a slot and the reading of its answer.
+ */
+static int capture_submit(struct fp_img_dev *idev, struct frame_slot *slot)
+{
+	struct etes603_dev *pdata = idev->priv;
+
+	slot->idev = idev;
+	msg_get_frame(&slot->msg, FRAME_WIDTH, 0, 0, 0, 0);
+	libusb_fill_bulk_transfer(slot->req, idev->udev, EP_OUT,
+			(unsigned char *)&slot->msg, MSG_HDR_SIZE + 6,
+			capture_cb, slot, BULK_TIMEOUT);
+	slot->req->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
+	libusb_fill_bulk_transfer(slot->ans, idev->udev, EP_IN, slot->frame,
+			FRAME_SIZE, capture_cb, slot, BULK_TIMEOUT);
+	slot->ans->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
+
+	stats_begin(&slot->sreq, slot->msg.cmd);
+	if (transport_get()->submit(slot->req)) {
+		stats_transfer(&slot->sreq, EP_OUT, 0, -EIO);
+		stats_end(pdata->stats, &slot->sreq);
+		return -1;
+	}
+	slot->pending++;
+	pdata->inflight++;
+	if (transport_get()->submit(slot->ans)) {
+		/* Accounted when the request completes. */
+		stats_transfer(&slot->sreq, EP_IN, 0, -EIO);
+		return -1;
+	}
+	slot->pending++;
+	pdata->inflight++;
+	slot->busy = 1;
+	return 0;
+}
+
+/*
+ * Set the consumer of the lines of the images of the assembled frames mode (or
+ * NULL). A line is given as soon as the merge of the next frames can not
+ * change it: the lines before braw_cur. The lines are valid only during the
+ * call and the image is still sent to libfprint at the end.
+ * The lines are given by the thread which merges the frames: the assembly
+ * worker with ETES603_WORKER=1 (see capture_worker), else the thread of the
+ * USB callbacks. The end of the image is always given from capture_finish,
+ * in the thread of the USB callbacks, once the worker is stopped, with the
+ * status of the capture (see dev_rows_fn). The callback must not call the
+ * driver and has to hand the lines over to its own thread if needed.
+ * Used by the live view of gui.c.
+ */
+__attribute__((used))
+static void dev_set_rows_cb(struct etes603_dev *dev, dev_rows_fn cb,
+	void *data)
+{
+	dev->rows_cb = cb;
+	dev->rows_data = data;
+}
+
+/*
+ * Give the final lines to the consumer, all of them if 'last'.
+ */
+static void capture_rows(struct etes603_dev *pdata, int last)
+{
+	size_t end = pdata->braw_cur - pdata->braw;
+
+	if (pdata->rows_cb == NULL)
+		return;
+	if (last)
+		end += FRAME_SIZE;
+	if (end > pdata->rows_done) {
+		pdata->rows_cb(pdata->rows_data, pdata->braw + pdata->rows_done,
+			       (end - pdata->rows_done) / (FRAME_WIDTH / 2), 0);
+		pdata->rows_done = end;
+	}
+}
+
+/*
+ * Merge a captured frame into the image.
+ * Returns 1 when the capture is finished.
+ */
+static int capture_frame(struct etes603_dev *pdata, uint8_t *frame)
+{
+	struct frame_desc fd;
+
+	process_frame_describe(&fd, frame);
+	if (process_frame_desc_empty(&fd, 1)) {
+		/* Finger leaves. */
+		return 1;
+	}
+	/* Merge new frame with current image, at most FRAME_HEIGHT lines
+	 * after braw_cur. */
+	if (braw_grow(pdata, FRAME_SIZE * 2)) {
+		fp_warn("Buffer is full");
+		return 1;
+	}
+	if (pdata->defer) {
+		/* Only stored, see capture_assemble */
+		memcpy(pdata->braw_cur, frame, FRAME_SIZE);
+		pdata->braw_cur += FRAME_SIZE;
+		return 0;
+	}
+	pdata->braw_cur = process_frame_predict(pdata->braw_cur, &fd,
+						&pdata->new_line);
+	capture_rows(pdata, 0);
+	return 0;
+}
+
+/*
+ * Deferred alignment: the frames of the swipe were stored in braw by
+ * capture_frame. They are aligned all together (see process_frames_align)
+ * then merged in a new buffer which replaces braw.
+ * Returns 0 on success.
+ */
+static int capture_assemble(struct etes603_dev *pdata)
+{
+	unsigned int k, n = (pdata->braw_cur - pdata->braw) / FRAME_SIZE;
+	/* Each frame adds FRAME_HEIGHT lines at most */
+	size_t size = (size_t)(n + 1) * FRAME_SIZE;
+	uint8_t *new_lines, *braw, *cur;
+
+	if (size < FRAMEFP_SIZE)
+		size = FRAMEFP_SIZE;
+	size = (size + BRAW_CHUNK - 1) / BRAW_CHUNK * BRAW_CHUNK;
+	new_lines = malloc(n + 1);
+	braw = malloc(size);
+	if (new_lines == NULL || braw == NULL
+	    || process_frames_align(pdata->braw, n, new_lines)) {
+		fp_err("cannot allocate memory");
+		free(new_lines);
+		free(braw);
+		return -1;
+	}
+	/* The first frame follows an empty frame, as with process_frame */
+	memset(braw, 0, FRAME_SIZE);
+	cur = braw;
+	for (k = 0; k < n; k++)
+		cur = process_frame_merge(cur, pdata->braw + k * FRAME_SIZE,
+					  new_lines[k]);
+	free(new_lines);
+	free(pdata->braw);
+	pdata->braw = braw;
+	pdata->braw_cur = cur;
+	pdata->braw_end = braw + size;
+	return 0;
+}
+
+/*
+ * Queue a frame for the worker. Returns -1 if the ring is full.
+ */
+static int ring_put(struct frame_ring *ring, const uint8_t *frame)
+{
+	unsigned int head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+		return -1;
+	memcpy(ring->frames[head % RING_SIZE], frame, FRAME_SIZE);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Return the oldest queued frame (NULL if none), it stays in the ring until
+ * ring_pop.
+ */
+static uint8_t *ring_peek(struct frame_ring *ring)
+{
+	unsigned int tail = ring->tail;
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+		return NULL;
+	return ring->frames[tail % RING_SIZE];
+}
+
+static void ring_pop(struct frame_ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Assembly worker: merge the frames queued by capture_process until the finger
+ * leaves. The USB callbacks only queue the frames and submit the next
+ * requests, so they are not delayed by the merge. The image (braw) belongs to
+ * the worker until it is stopped by capture_finish.
+ */
+static void *capture_worker(void *data)
+{
+	struct etes603_dev *pdata = data;
+	uint8_t *frame;
+
+	for (;;) {
+		sem_wait(&pdata->worker_sem);
+		if (__atomic_load_n(&pdata->worker_stop, __ATOMIC_ACQUIRE))
+			break;
+		if ((frame = ring_peek(&pdata->ring)) == NULL)
+			continue;
+		/* The frames after the last one are dropped. */
+		if (!pdata->worker_end && capture_frame(pdata, frame))
+			__atomic_store_n(&pdata->worker_end, 1, __ATOMIC_RELEASE);
+		ring_pop(&pdata->ring);
+	}
+	return NULL;
 }
 
 /*
- * Return true if the frame is almost empty.
- * If mode is 0, it is high sensibility for device tuning.
- * Otherwise, for capture mode.
+ * Start the worker of a capture. Frames are merged in the callbacks if it
+ * cannot be started.
  */
-static int process_frame_empty(uint8_t *frame, size_t size, int mode)
+static void capture_worker_start(struct etes603_dev *pdata)
 {
-	unsigned int sum = process_get_brightness(frame, size);
-	/* Allow an average of 'threshold' luminosity per pixel */
-	if (mode) {
-		/* mode capture */
-		if (sum < size * 2)
-			return 1;
-	} else {
-		/* mode tuning */
-		if (sum < size)
-			return 1;
+	pdata->ring.head = pdata->ring.tail = 0;
+	pdata->worker_stop = 0;
+	pdata->worker_end = 0;
+	pdata->ring_full = 0;
+	if (sem_init(&pdata->worker_sem, 0, 0)) {
+		fp_warn("sem_init failed with %d, no worker", errno);
+		return;
 	}
-	return 0;
+	if (pthread_create(&pdata->worker_thread, NULL, capture_worker, pdata)) {
+		fp_warn("pthread_create failed, no worker");
+		sem_destroy(&pdata->worker_sem);
+		return;
+	}
+	pdata->worker_run = 1;
 }
 
 /*
- * Compare lines in 'dst' and 'src'.
- * Return the number of new lines in 'src'.
+ * Stop the worker, the queued frames are dropped.
  */
-static int process_find_dup(uint8_t *dst, uint8_t *src, uint8_t width,
-	uint8_t height)
+static void capture_worker_stop(struct etes603_dev *pdata)
 {
-	int v;
-	unsigned int i, j;
-	/* Total errors when substract src from dst */
-	unsigned int sum_error;
-	/* Number of lines that matches */
-	unsigned int nb = height;
-	/* Size in byte is width * height / 2 pixels per byte */
-	unsigned int bwidth = width / 2;
-	unsigned int bsize = bwidth * height;
-	/* Maximal error threshold to consider that lines match. */
-	/* Value 6 is empirical. */
-	unsigned int max_error = process_get_brightness(src, bsize) / 6;
-	/* Typical frame: 384 bytes / 196 px width / 4 bits value */
-	/* Scan lines, assuming first that all lines match. */
-	for (i = 0; i < height; i++) {
-		sum_error = 0;
-		for (j = 0; j < bwidth * (height - i); j++) {
-			/* subtract and absolute value */
-			v = (int)(dst[j] & 0x0F) - (int)(src[j] & 0x0F);
-			/* note: we could use ^2 */
-			v = v >= 0 ? v : -v;
-			sum_error += v;
-			v = (int)(dst[j] >> 4) - (int)(src[j] >> 4);
-			v = v >= 0 ? v : -v;
-			sum_error += v;
-		}
-		/* The usage of int makes value imprecise when divide. */
-		sum_error *= 127;
-		sum_error = sum_error / j; /* Avg error/pixel */
-		if (sum_error < max_error) {
-			max_error = sum_error;
-			nb = i;
-		}
-		dst += bwidth; /* Next line */
+	if (!pdata->worker_run)
+		return;
+	__atomic_store_n(&pdata->worker_stop, 1, __ATOMIC_RELEASE);
+	sem_post(&pdata->worker_sem);
+	pthread_join(pdata->worker_thread, NULL);
+	sem_destroy(&pdata->worker_sem);
+	pdata->worker_run = 0;
+	if (pdata->ring_full) {
+		fp_dbg("%u frames waited for the worker", pdata->ring_full);
 	}
-	return nb;
 }
 
 /*
- * The first 'merge' bytes from src and dst are merged then raw copy.
+ * Called when the capture is stopped and all its transfers are completed.
  */
-static void merge_and_append(uint8_t *dst, uint8_t *src, size_t merge,
-	size_t size)
+static void capture_finish(struct fp_img_dev *idev)
 {
-	size_t i;
-	uint8_t pxl, pxh;
-	assert(merge <= size);
-	for (i = 0; i < merge; i++) {
-		pxl = ((dst[i] & 0x0F) + (src[i] & 0x0F)) >> 1;
-		pxh = ((dst[i] >> 4) + (src[i] >> 4)) >> 1;
-		dst[i] = pxl | (pxh << 4);
+	struct etes603_dev *pdata = idev->priv;
+	int status;
+
+	capture_worker_stop(pdata);
+	if (pdata->defer) {
+		if (!pdata->deactivating && !pdata->capture_err
+		    && capture_assemble(pdata))
+			pdata->capture_err = -ENOMEM;
+		/* The stored frames are not lines of the image. */
+		if (pdata->deactivating || pdata->capture_err)
+			pdata->rows_done = pdata->braw_cur + FRAME_SIZE
+					 - pdata->braw;
 	}
-	for (i = merge; i < size; i++) {
-		dst[i] = src[i];
+	/* The consumer of the lines sees the end of the image even if it is
+	 * not sent, and why. */
+	capture_rows(pdata, 1);
+	status = pdata->deactivating ? -ECANCELED : pdata->capture_err;
+	if (pdata->rows_cb != NULL)
+		pdata->rows_cb(pdata->rows_data, NULL, 0, status);
+	/* Set STATE_DEACTIVATING before sending image because deactivation is
+	 * called when image is sent. */
+	pdata->state = STATE_DEACTIVATING;
+	if (pdata->deactivating) {
+		complete_deactivation(idev);
+	} else if (pdata->capture_err) {
+		fp_err("Error occured in async process");
+		fpi_imgdev_session_error(idev, pdata->capture_err);
+	} else {
+		/* Finger leaves, send final image. */
+		transform_to_fpi(idev);
 	}
 }
 
-
-
 /*
- * Integrate the new frame 'src' into previous assembled frames 'dst'.
- * 'dst' must point to the last buffer and have 384 bytes free at the end to append data.
- * 'src' must point to the frame received (384 bytes).
+ * Start the pipelined capture: 'depth' frame requests are kept in flight so
+ * the sensor does not wait for the host between two frames.
  */
-static uint8_t *process_frame(uint8_t *dst, uint8_t *src)
+static void capture_start(struct fp_img_dev *idev)
 {
-	int new_line;
-
-	/* TODO sweep direction to determine... merging will be different. */
-	new_line = process_find_dup(dst, src, FRAME_WIDTH, FRAME_HEIGHT);
-	dst += (FRAME_WIDTH / 2) * new_line;
-	/* merge_and_append give a better result than just copying */
-	merge_and_append(dst, src, (FRAME_HEIGHT - new_line) * (FRAME_WIDTH / 2), FRAME_SIZE);
-	/* memcpy(dst, src, FRAME_SIZE); */
+	struct etes603_dev *pdata = idev->priv;
+	unsigned int i;
 
-	return dst;
+	pdata->state = STATE_CAPTURING;
+	pdata->seq = 0;
+	pdata->capture_err = 0;
+	pdata->rows_done = 0;
+	if (pdata->worker)
+		capture_worker_start(pdata);
+	for (i = 0; i < pdata->depth; i++) {
+		if (capture_submit(idev, &pdata->slots[i])) {
+			pdata->capture_err = -EIO;
+			pdata->state = STATE_CAPTURING_END;
+			break;
+		}
+	}
+	if (pdata->state == STATE_CAPTURING_END && pdata->inflight == 0)
+		capture_finish(idev);
 }
 
-/* Transform 4 bits image to 8 bits image */
-static void process_transform4_to_8(uint8_t *input, unsigned int input_size,
-	uint8_t *output)
+/*
+ * Asynchronous callback of the pipelined capture.
+ * Transfers may complete in any order but frames are processed in the order
+ * they were requested. Once the capture is stopped, in flight requests are
+ * still read to keep the sensor in sync.
+ */
+static void capture_cb(struct libusb_transfer *transfer)
 {
-	unsigned int i, j = 0;
-	for (i = 0; i < input_size; i++, j += 2) {
-		/* 16 gray levels transform to 256 levels using << 4 */
-		output[j] = input[i] & 0xF0;
-		output[j+1] = input[i] << 4;
+	struct frame_slot *slot = transfer->user_data;
+	struct fp_img_dev *idev = slot->idev;
+	struct etes603_dev *pdata = idev->priv;
+
+	slot->pending--;
+	pdata->inflight--;
+	transfer_done(&slot->sreq, transfer);
+	if (slot->pending == 0)
+		stats_end(pdata->stats, &slot->sreq);
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		fp_warn("transfer is not completed (state=%d/status=%d)",
+			pdata->state, transfer->status);
+		pdata->capture_err = -EIO;
+		pdata->state = STATE_CAPTURING_END;
 	}
+	capture_process(idev);
 }
 
-
-/* libfprint stuff */
-
 /*
- * Called when the deactivation was requested.
+ * The ring was full, try again to queue the frames.
  */
-static void complete_deactivation(struct fp_img_dev *idev)
+static void capture_retry(void *data)
 {
-	struct etes603_dev *dev = idev->priv;
+	struct fp_img_dev *idev = data;
+	struct etes603_dev *pdata = idev->priv;
 
-	/* TODO I guess I should not completely deinit the sensor? */
-	/* TODO Change at least to SLEEP_MODE ? */
-	dev->deactivating = FALSE;
-	fpi_imgdev_deactivate_complete(idev);
+	pdata->ring_timer = NULL;
+	capture_process(idev);
 }
 
 /*
- * Transforms the raw data to fprint data and submit it to fprint.
+ * Process the received frames in order and reuse their slots. With a worker,
+ * the frames are only queued: when the ring is full, the slot waits (the
+ * sensor is not asked for more frames) and the queuing is retried later.
  */
-static int transform_to_fpi(struct fp_img_dev *idev)
+static void capture_process(struct fp_img_dev *idev)
 {
-	struct fp_img *img;
-	struct etes603_dev *dev = idev->priv;
+	struct etes603_dev *pdata = idev->priv;
+	struct frame_slot *slot;
 
-	if (dev->mode == 1) {
-		/* Assembled frames */
-		/* braw_cur points to the last frame so needs to adjust to end */
-		unsigned int size = dev->braw_cur + FRAME_SIZE - dev->braw;
-		/* es603 has 2 pixels per byte. */
-		img = fpi_img_new(size * 2);
-		img->flags = FP_IMG_COLORS_INVERTED | FP_IMG_V_FLIPPED;
-		img->height = size * 2 / FRAME_WIDTH;
-		/* img->width could be set 256 always but need a new function to handle this */
-		img->width = FRAME_WIDTH;
-		process_transform4_to_8(dev->braw, size, (uint8_t*)img->data);
-	} else {
-		/* FingerPrint Frame */
-		img = fpi_img_new(FRAMEFP_SIZE * 2);
-		/* Images received are white on black, so invert it (FP_IMG_COLORS_INVERTED) */
-		/* TODO for different sweep direction ? FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED */
-		img->flags = FP_IMG_COLORS_INVERTED | FP_IMG_V_FLIPPED;
-		/* img->width can only be changed when -1 was set at init */
-		img->width = FRAMEFP_WIDTH;
-		img->height = FRAMEFP_HEIGHT;
-		process_transform4_to_8(dev->braw, FRAMEFP_SIZE, (uint8_t*)img->data);
+	if (pdata->deactivating
+	    || __atomic_load_n(&pdata->worker_end, __ATOMIC_ACQUIRE))
+		pdata->state = STATE_CAPTURING_END;
+
+	while (pdata->state == STATE_CAPTURING) {
+		slot = &pdata->slots[pdata->seq % pdata->depth];
+		if (!slot->busy || slot->pending)
+			break;
+		if (pdata->worker_run) {
+			if (ring_put(&pdata->ring, slot->frame)) {
+				if (pdata->ring_full++ == 0) {
+					fp_warn("frame assembly is late");
+				}
+				if (pdata->ring_timer == NULL)
+					pdata->ring_timer = fpi_timeout_add(
+						RING_RETRY, capture_retry, idev);
+				/* Lost if no timer, the capture ends. */
+				if (pdata->ring_timer == NULL) {
+					pdata->capture_err = -ENOMEM;
+					pdata->state = STATE_CAPTURING_END;
+				}
+				break;
+			}
+			sem_post(&pdata->worker_sem);
+		} else if (capture_frame(pdata, slot->frame)) {
+			pdata->state = STATE_CAPTURING_END;
+			break;
+		}
+		slot->busy = 0;
+		pdata->seq++;
+		if (capture_submit(idev, slot)) {
+			pdata->capture_err = -EIO;
+			pdata->state = STATE_CAPTURING_END;
+		}
 	}
-	/* Send image to fpi */
-	fpi_imgdev_image_captured(idev, img);
-	/* Indicate that the finger is removed. */
-	fpi_imgdev_report_finger_status(idev, FALSE);
 
-	return 0;
+	if (pdata->state == STATE_CAPTURING_END && pdata->inflight == 0
+	    && pdata->ring_timer == NULL)
+		capture_finish(idev);
 }
 
-/* state for asynchronous functions */
-#define STATE_INIT                     1
-#define STATE_FINGER_REQ_SEND          2
-#define STATE_FINGER_REQ_RECV          3
-#define STATE_FINGER_ANS               4
-#define STATE_CAPTURING_REQ_SEND       5
-#define STATE_CAPTURING_REQ_RECV       6
-#define STATE_CAPTURING_ANS            7
-#define STATE_INIT_FP_REQ_SEND         8
-#define STATE_INIT_FP_REQ_RECV         9
-#define STATE_INIT_FP_ANS              10
-#define STATE_CAPTURING_FP_REQ_SEND    11
-#define STATE_CAPTURING_FP_REQ_RECV    12
-#define STATE_CAPTURING_FP_ANS         13
-#define STATE_DEACTIVATING             14
-
-static int async_transfer(struct fp_img_dev *dev, unsigned char ep,
-		unsigned char *msg_data, unsigned int msg_size);
-
 /*
  * Asynchronous function callback for asynchronous read buffer.
  */
@@ -1539,6 +4397,14 @@ static void async_transfer_cb(struct libusb_transfer *transfer)
 	struct etes603_dev *pdata = idev->priv;
 	struct egis_msg *msg;
 
+	/* To ensure non-fragmented message, LIBUSB_TRANSFER_SHORT_NOT_OK is
+	 * used. */
+	if (pdata->state != STATE_INIT) {
+		transfer_done(&pdata->sreq, transfer);
+		if (transfer->endpoint == EP_IN
+		    || transfer->status != LIBUSB_TRANSFER_COMPLETED)
+			stats_end(pdata->stats, &pdata->sreq);
+	}
 	/* Check status except if initial state (entrypoint) */
 	if (pdata->state != STATE_INIT
 	    && transfer->status != LIBUSB_TRANSFER_COMPLETED) {
@@ -1546,11 +4412,6 @@ static void async_transfer_cb(struct libusb_transfer *transfer)
 			pdata->state, transfer->status);
 		goto err;
 	}
-	/* To ensure non-fragmented message, LIBUSB_TRANSFER_SHORT_NOT_OK is
-	 * used. */
-	if (pdata->state != STATE_INIT) {
-		debug_output(transfer->endpoint, transfer->buffer, transfer->actual_length);
-	}
 
 goback:
 
@@ -1568,7 +4429,7 @@ goback:
 		/* no break, we are continuing with next step */
 
 	case STATE_FINGER_REQ_SEND:
-		msg = malloc(sizeof(struct egis_msg));
+		msg = &pdata->msg;
 		msg_get_frame(msg, FRAME_WIDTH, 0, 0, 0, 0);
 		if (async_transfer(idev, EP_OUT, (unsigned char *)msg, MSG_HDR_SIZE + 6)) {
 			goto err;
@@ -1578,10 +4439,8 @@ goback:
 
 	case STATE_FINGER_REQ_RECV:
 		/* The request succeeds. */
-		msg = malloc(FRAME_SIZE);
-		memset(msg, 0, FRAME_SIZE);
 		/* Now ask for receiving data. */
-		if (async_transfer(idev, EP_IN, (unsigned char *)msg, FRAME_SIZE)) {
+		if (async_transfer(idev, EP_IN, pdata->buf, FRAME_SIZE)) {
 			goto err;
 		}
 		pdata->state = STATE_FINGER_ANS;
@@ -1598,58 +4457,17 @@ goback:
 		/* Select mode for capturing. */
 		if (pdata->mode == 1) {
 			fp_dbg("Finger is detected, assembled frames mode");
-			pdata->state = STATE_CAPTURING_REQ_SEND;
-		} else {
-			fp_dbg("Finger is detected, FP mode");
-			pdata->state = STATE_INIT_FP_REQ_SEND;
-			goto MODE_FP;
-		}
-		/* no break, continue to state STATE_CAPTURING_REQ_SEND. */
-
-	case STATE_CAPTURING_REQ_SEND:
-		msg = malloc(sizeof(struct egis_msg));
-		msg_get_frame(msg, FRAME_WIDTH, 0, 0, 0, 0);
-		if (async_transfer(idev, EP_OUT, (unsigned char *)msg, MSG_HDR_SIZE + 6)) {
-			goto err;
-		}
-		pdata->state = STATE_CAPTURING_REQ_RECV;
-		break;
-
-	case STATE_CAPTURING_REQ_RECV:
-		/* The request succeeds. */
-		msg = malloc(FRAME_SIZE);
-		memset(msg, 0, FRAME_SIZE);
-		/* Receiving data. */
-		if (async_transfer(idev, EP_IN, (unsigned char *)msg, FRAME_SIZE)) {
-			goto err;
-		}
-		pdata->state = STATE_CAPTURING_ANS;
-		break;
-
-	case STATE_CAPTURING_ANS:
-		if (process_frame_empty(transfer->buffer, FRAME_SIZE, 1)) {
-			/* Finger leaves, send final image. */
-			pdata->state = STATE_DEACTIVATING;
-			transform_to_fpi(idev);
-			break;
-		}
-		/* Merge new frame with current image. */
-		pdata->braw_cur = process_frame(pdata->braw_cur, transfer->buffer);
-		if ((pdata->braw_cur + FRAME_SIZE) >= pdata->braw_end) {
-			fp_warn("STATE_CAPTURING_ANS: Buffer is full");
-			/* Buffer is full, send final image. */
-			pdata->state = STATE_DEACTIVATING;
-			transform_to_fpi(idev);
+			/* The pipelined capture has its own callback. */
+			capture_start(idev);
 			break;
 		}
-		/* Ask new frame. */
-		pdata->state = STATE_CAPTURING_REQ_SEND;
-		goto goback;
+		fp_dbg("Finger is detected, FP mode");
+		pdata->state = STATE_INIT_FP_REQ_SEND;
+		/* no break, continue to state STATE_INIT_FP_REQ_SEND. */
 
 	case STATE_INIT_FP_REQ_SEND:
-MODE_FP:
 		/* Change to mode REG_MODE_FP */
-		msg = malloc(sizeof(struct egis_msg));
+		msg = &pdata->msg;
 		msg_header_prepare(msg);
 		msg->cmd = CMD_WRITE_REG;
 		msg->egis_writereg.nb = 0x01;
@@ -1663,10 +4481,8 @@ MODE_FP:
 
 	case STATE_INIT_FP_REQ_RECV:
 		/* The request succeeds. */
-		msg = malloc(sizeof(struct egis_msg));
-		memset(msg, 0, sizeof(struct egis_msg));
 		/* Receiving data. */
-		if (async_transfer(idev, EP_IN, (unsigned char *)msg, MSG_HDR_SIZE)) {
+		if (async_transfer(idev, EP_IN, pdata->buf, MSG_HDR_SIZE)) {
 			goto err;
 		}
 		pdata->state = STATE_INIT_FP_ANS;
@@ -1682,7 +4498,7 @@ MODE_FP:
 		/* continuing, now ask for the fingerprint frame */
 
 	case STATE_CAPTURING_FP_REQ_SEND:
-		msg = malloc(sizeof(struct egis_msg));
+		msg = &pdata->msg;
 		msg_get_fp(msg, 0x01, 0xF4, 0x02, 0x01, 0x64);
 		if (async_transfer(idev, EP_OUT, (unsigned char *)msg, MSG_HDR_SIZE + 5)) {
 			goto err;
@@ -1692,17 +4508,14 @@ MODE_FP:
 
 	case STATE_CAPTURING_FP_REQ_RECV:
 		/* The request succeeds. */
-		msg = malloc(FRAMEFP_SIZE);
-		memset(msg, 0, FRAMEFP_SIZE);
-		/* Receiving data. */
-		if (async_transfer(idev, EP_IN, (unsigned char *)msg, FRAMEFP_SIZE)) {
+		/* Receiving data directly in the raw buffer. */
+		if (async_transfer(idev, EP_IN, pdata->braw, FRAMEFP_SIZE)) {
 			goto err;
 		}
 		pdata->state = STATE_CAPTURING_FP_ANS;
 		break;
 
 	case STATE_CAPTURING_FP_ANS:
-		memcpy(pdata->braw, transfer->buffer, transfer->actual_length);
 		/* Set STATE_DEACTIVATING before sending image because
 		 * deactivation is called when image is sent. */
 		pdata->state = STATE_DEACTIVATING;
@@ -1719,8 +4532,7 @@ MODE_FP:
 		goto err;
 	}
 
-	/* No need to free buffer or transfer, LIBUSB_TRANSFER_FREE_BUFFER and
-	 * LIBUSB_TRANSFER_FREE_TRANSFER are used. */
+	/* No need to free buffer or transfer, they belong to the device. */
 
 	return;
 err:
@@ -1732,35 +4544,230 @@ err:
 
 /*
  * Asynchronous read buffer transfer.
+ * The transfer of the device for the endpoint 'ep' is reused, so only one
+ * request and one answer can be in flight.
  */
 static int async_transfer(struct fp_img_dev *idev, unsigned char ep,
 		unsigned char *msg_data, unsigned int msg_size)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-
-	if (!transfer)
-		return -ENOMEM;
+	struct etes603_dev *pdata = idev->priv;
+	struct libusb_transfer *transfer;
 
+	transfer = (ep == EP_OUT) ? pdata->req : pdata->ans;
 	libusb_fill_bulk_transfer(transfer, idev->udev, ep, msg_data, msg_size,
 			async_transfer_cb, idev, BULK_TIMEOUT);
-	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK
-			| LIBUSB_TRANSFER_FREE_BUFFER
-			| LIBUSB_TRANSFER_FREE_TRANSFER;
+	/* Buffers belong to the device, so they must not be freed. */
+	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
 
-	if (libusb_submit_transfer(transfer)) {
-		libusb_free_transfer(transfer);
+	/* A request starts with its message. */
+	if (ep == EP_OUT)
+		stats_begin(&pdata->sreq, ((struct egis_msg *)msg_data)->cmd);
+	if (transport_get()->submit(transfer)) {
+		stats_transfer(&pdata->sreq, ep, 0, -EIO);
+		stats_end(pdata->stats, &pdata->sreq);
 		return -1;
 	}
 	return 0;
 }
 
+#define RESET_REGS                 1    /* Set the registers as sensor_close */
+#define RESET_DONE                 2
+
+/*
+ * Sequence after a failed open.
+ */
+static int open_reset_step(struct etes603_dev *dev)
+{
+	if (dev->step == RESET_REGS) {
+		dev->step = RESET_DONE;
+		if (seq_write_regs(dev, 24, CLOSE_REGS))
+			return SEQ_REQUEST;
+	}
+	return SEQ_DONE;
+}
+
+/*
+ * End of a failed open: free the device and report the error of the open.
+ */
+static void open_reset_done(struct fp_img_dev *idev, int status)
+{
+	struct etes603_dev *dev = idev->priv;
+	int err = dev->open_status;
+
+	if (status) {
+		fp_warn("cannot reset the sensor (err=%d)", status);
+	}
+	sensor_close(dev, NULL);
+	idev->priv = NULL;
+	transport_get()->release(idev->udev);
+	fpi_imgdev_open_complete(idev, err);
+}
+
+/*
+ * End of the open sequence.
+ */
+static void open_complete(struct fp_img_dev *idev, int status)
+{
+	struct etes603_dev *dev = idev->priv;
+
+	if (status) {
+		fp_err("cannot open sensor (err=%d, step=%d)", status,
+		       dev->step);
+		/* The init process may have aborted in the middle, force
+		 * closing it. This is called from a transfer callback, so the
+		 * registers are set asynchronously (not with sensor_close). */
+		dev->open_status = status;
+		seq_start(idev, open_reset_step, RESET_REGS, open_reset_done);
+		return;
+	}
+	fpi_imgdev_open_complete(idev, status);
+}
+
+static void seq_cb(struct libusb_transfer *transfer);
+
+/*
+ * Run the steps of the sequence until a request is submitted or a wait is
+ * scheduled. dev->seq_done is called at the end of the sequence.
+ */
+static void seq_run(struct fp_img_dev *idev)
+{
+	struct etes603_dev *dev = idev->priv;
+	int ret;
+
+	ret = dev->seq_step(dev);
+	if (ret == SEQ_REQUEST) {
+		libusb_fill_bulk_transfer(dev->req, idev->udev, EP_OUT,
+				(unsigned char *)&dev->msg, dev->op_size,
+				seq_cb, idev, BULK_TIMEOUT);
+		dev->req->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
+		stats_begin(&dev->sreq, dev->msg.cmd);
+		if (transport_get()->submit(dev->req) == 0)
+			return;
+		stats_transfer(&dev->sreq, EP_OUT, 0, -EIO);
+		stats_end(dev->stats, &dev->sreq);
+		seq_failed(dev);
+		ret = -EIO;
+	} else if (ret == SEQ_WAIT) {
+		dev->timer = fpi_timeout_add(dev->delay, seq_timeout, idev);
+		if (dev->timer != NULL)
+			return;
+		ret = -ENOMEM;
+	}
+	dev->seq_done(idev, ret);
+}
+
+/*
+ * Called when the wait asked by a step is over.
+ */
+static void seq_timeout(void *data)
+{
+	struct fp_img_dev *idev = data;
+	struct etes603_dev *dev = idev->priv;
+
+	/* The timeout is freed once expired. */
+	dev->timer = NULL;
+	seq_run(idev);
+}
+
+/*
+ * Asynchronous callback of the sequences: the request is sent, then its
+ * answer is read and processed by the next step.
+ */
+static void seq_cb(struct libusb_transfer *transfer)
+{
+	struct fp_img_dev *idev = transfer->user_data;
+	struct etes603_dev *dev = idev->priv;
+
+	transfer_done(&dev->sreq, transfer);
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		fp_warn("transfer is not completed (step=%d/status=%d)",
+			dev->step, transfer->status);
+		stats_end(dev->stats, &dev->sreq);
+		goto err;
+	}
+
+	if (transfer == dev->req) {
+		/* Messages may be shorter than the buffer but a frame must be
+		 * complete. */
+		libusb_fill_bulk_transfer(dev->ans, idev->udev, EP_IN, dev->buf,
+				dev->op_frame ? FRAME_SIZE : sizeof(struct egis_msg),
+				seq_cb, idev, BULK_TIMEOUT);
+		dev->ans->flags = dev->op_frame ? LIBUSB_TRANSFER_SHORT_NOT_OK : 0;
+		if (transport_get()->submit(dev->ans)) {
+			stats_transfer(&dev->sreq, EP_IN, 0, -EIO);
+			stats_end(dev->stats, &dev->sreq);
+			goto err;
+		}
+		return;
+	}
+	stats_end(dev->stats, &dev->sreq);
+	if (seq_answer(dev, transfer->actual_length))
+		goto err;
+	seq_run(idev);
+	return;
+err:
+	seq_failed(dev);
+	dev->seq_done(idev, -EIO);
+}
+
+/*
+ * Start a sequence at the step 'first', 'done' is called at its end with the
+ * error status.
+ */
+static void seq_start(struct fp_img_dev *idev, int (*step)(struct etes603_dev *),
+	unsigned int first, void (*done)(struct fp_img_dev *, int))
+{
+	struct etes603_dev *dev = idev->priv;
+
+	dev->seq_step = step;
+	dev->seq_done = done;
+	dev->step = first;
+	seq_run(idev);
+}
+
+/*
+ * Wait for a finger with frames, then capture it.
+ * The sensor must be in sensor mode (see CONTACT_SENSOR).
+ */
+static void finger_wait_frames(struct fp_img_dev *idev)
+{
+	struct etes603_dev *dev = idev->priv;
+	struct libusb_transfer fake_transfer;
+
+	/* Enable an entrypoint in the asynchronous mess. */
+	dev->state = STATE_INIT;
+	fake_transfer.user_data = idev;
+	async_transfer_cb(&fake_transfer);
+}
+
+/*
+ * End of the contact detection sequence.
+ */
+static void contact_done(struct fp_img_dev *idev, int status)
+{
+	struct etes603_dev *dev = idev->priv;
+
+	if (dev->deactivating) {
+		complete_deactivation(idev);
+		return;
+	}
+	if (status) {
+		dev->state = STATE_DEACTIVATING;
+		fp_err("Error occured in async process");
+		fpi_imgdev_session_error(idev, status);
+		return;
+	}
+	/* The sensor is in sensor mode, the frames confirm that the finger
+	 * is present. */
+	finger_wait_frames(idev);
+}
+
 /*
  * Libfprint asks for activation.
  */
 static int dev_activate(struct fp_img_dev *idev, enum fp_imgdev_state state)
 {
-	char *mode;
-	struct libusb_transfer fake_transfer;
+	char *mode, *depth, *detect, *worker, *defer;
 	struct etes603_dev *dev = idev->priv;
 
 	/* TODO See how to manage state */
@@ -1777,23 +4784,60 @@ static int dev_activate(struct fp_img_dev *idev, enum fp_imgdev_state state)
 	/* Reset info and data */
 	dev->deactivating = FALSE;
 	dev->braw_cur = dev->braw;
-	memset(dev->braw, 0, (dev->braw_end - dev->braw));
+	dev->new_line = -1;
+	/* Only the first frame is read before being written: the merge compares
+	 * against braw_cur, and a fingerprint image overwrites the beginning. */
+	memset(dev->braw, 0, FRAME_SIZE);
 	/* Use default mode (FingerPrint, FP) or use environment defined mode */
 	dev->mode = 0;
 	if ((mode = getenv("ETES603_MODE")) != NULL) {
 		if (mode[0] == '1')
 			dev->mode = 1;
 	}
+	/* Number of frame requests in flight when capturing frames */
+	dev->depth = CAPTURE_DEPTH_DEF;
+	if ((depth = getenv("ETES603_DEPTH")) != NULL) {
+		dev->depth = strtoul(depth, NULL, 10);
+		if (dev->depth < 1 || dev->depth > CAPTURE_DEPTH_MAX) {
+			fp_warn("ETES603_DEPTH must be between 1 and %d",
+				CAPTURE_DEPTH_MAX);
+			dev->depth = CAPTURE_DEPTH_DEF;
+		}
+	}
 
-	/* Preparing capture */
-	frame_prepare_capture(dev);
+	/* Merge the frames in a worker thread */
+	dev->worker = 0;
+	if ((worker = getenv("ETES603_WORKER")) != NULL) {
+		if (worker[0] == '1')
+			dev->worker = 1;
+	}
 
-	/* Enable an entrypoint in the asynchronous mess. */
-	dev->state = STATE_INIT;
-	fake_transfer.user_data = idev;
-	async_transfer_cb(&fake_transfer);
+	/* Align the frames at the end of the swipe */
+	dev->defer = 0;
+	if ((defer = getenv("ETES603_DEFER")) != NULL) {
+		if (defer[0] == '1')
+			dev->defer = 1;
+	}
+
+	/* Finger detection with the contact sensor (default) or with frames */
+	dev->detect = 1;
+	if ((detect = getenv("ETES603_DETECT")) != NULL) {
+		if (detect[0] == '0')
+			dev->detect = 0;
+	}
 
+	/* Waiting a finger with frames in sensor mode uses much more power
+	 * and USB traffic than the contact sensor, so the sensor mode is only
+	 * set after a contact. The capture starts in contact_done. */
+	dev->state = STATE_CONTACT;
+	/* The activation completes before the sequence starts: a request
+	 * which cannot be submitted ends it with a session error, which
+	 * libfprint only accepts once the device is active. */
 	fpi_imgdev_activate_complete(idev, 0);
+	if (dev->detect == 1)
+		seq_start(idev, contact_step, CONTACT_INIT, contact_done);
+	else
+		seq_start(idev, contact_step, CONTACT_SENSOR, contact_done);
 	return 0;
 }
 
@@ -1804,10 +4848,17 @@ static void dev_deactivate(struct fp_img_dev *idev)
 {
 	struct etes603_dev *dev = idev->priv;
 	/* complete_deactivation can be called asynchronously. */
-	if (dev->state != STATE_DEACTIVATING)
+	if (dev->state != STATE_DEACTIVATING) {
 		dev->deactivating = TRUE;
-	else
+		/* Do not wait for the next contact test. */
+		if (dev->timer != NULL) {
+			fpi_timeout_cancel(dev->timer);
+			dev->timer = NULL;
+			seq_run(idev);
+		}
+	} else {
 		complete_deactivation(idev);
+	}
 }
 
 /*
@@ -1825,26 +4876,23 @@ static int dev_init(struct fp_img_dev *idev, unsigned long driver_data)
 		return -1;
 	}
 
-	ret = libusb_claim_interface(idev->udev, 0);
+	ret = transport_get()->claim(idev->udev);
 	if (ret != LIBUSB_SUCCESS) {
 		fp_err("libusb_claim_interface failed on interface 0 "
 		       "(err=%d)", ret);
 		return ret;
 	}
 
-	/* Note: it does make sense to use asynchronous method for initializing
-	 * the device. It also simplifies a lot the design of the driver. */
-	/* Initialize the sensor */
 	if ((dev = sensor_open(idev->udev)) == NULL) {
-		fp_err("cannot open sensor (err=%d)", ret);
-		/* The init process may have aborted in the middle, force
-		 * closing it. */
-		sensor_close(dev, idev->udev);
-		return ret;
+		transport_get()->release(idev->udev);
+		return -ENOMEM;
 	}
 
+	/* Initializing and tuning the sensor takes many requests, they are
+	 * sent asynchronously and fpi_imgdev_open_complete is called at the
+	 * end of the open sequence. */
 	idev->priv = dev;
-	fpi_imgdev_open_complete(idev, 0);
+	seq_start(idev, open_step, OPEN_INFO, open_complete);
 	return 0;
 }
 
@@ -1858,7 +4906,7 @@ static void dev_deinit(struct fp_img_dev *idev)
 	sensor_close(dev, idev->udev);
 	idev->priv = NULL;
 
-	libusb_release_interface(idev->udev, 0);
+	transport_get()->release(idev->udev);
 	fpi_imgdev_close_complete(idev);
 }
 
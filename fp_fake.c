@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 #include <libusb.h>
 #include "fp_fake.h"
 
@@ -9,8 +10,12 @@
 
 libusb_context *fpi_usb_ctx = NULL;
 
-void fpi_imgdev_open_complete (struct fp_img_dev *imgdev UNUSED, int status UNUSED)
+/* Status of the asynchronous open (1 while in progress) */
+static int open_status;
+
+void fpi_imgdev_open_complete (struct fp_img_dev *imgdev UNUSED, int status)
 {
+	open_status = status;
 }
 
 void fpi_imgdev_close_complete (struct fp_img_dev *imgdev UNUSED)
@@ -60,12 +65,17 @@ void fpi_log(enum fpi_log_level level, const char *component,
 	fprintf(stream, "\n");
 }
 
-void fpi_imgdev_activate_complete(struct fp_img_dev *imgdev UNUSED, int i UNUSED)
+/* The device is activated (dev_activate) and not yet deactivated */
+static int active;
+
+void fpi_imgdev_activate_complete(struct fp_img_dev *imgdev UNUSED, int i)
 {
+	active = (i == 0);
 }
 
 void fpi_imgdev_deactivate_complete(struct fp_img_dev *imgdev UNUSED)
 {
+	active = 0;
 }
 
 struct fp_img *fpi_img_new(size_t length)
@@ -76,16 +86,114 @@ struct fp_img *fpi_img_new(size_t length)
 	return img;
 }
 
-void fpi_imgdev_image_captured(struct fp_img_dev *imgdev UNUSED, struct fp_img *img UNUSED)
+/* The image belongs to libfprint once sent */
+void fpi_imgdev_image_captured(struct fp_img_dev *imgdev UNUSED, struct fp_img *img)
 {
+	free(img);
 }
 
 void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev UNUSED, gboolean present UNUSED)
 {
 }
 
+/* Timeouts of the driver, handled by fake_handle_events */
+struct fpi_timeout {
+	struct timespec expiry;
+	fpi_timeout_fn callback;
+	void *data;
+	struct fpi_timeout *next;
+};
+
+static struct fpi_timeout *timeouts = NULL;
+
+struct fpi_timeout *fpi_timeout_add(unsigned int msec, fpi_timeout_fn callback,
+	void *data)
+{
+	struct fpi_timeout *timeout;
+
+	if ((timeout = malloc(sizeof(*timeout))) == NULL)
+		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &timeout->expiry);
+	timeout->expiry.tv_sec += msec / 1000;
+	timeout->expiry.tv_nsec += (msec % 1000) * 1000000;
+	if (timeout->expiry.tv_nsec >= 1000000000) {
+		timeout->expiry.tv_sec++;
+		timeout->expiry.tv_nsec -= 1000000000;
+	}
+	timeout->callback = callback;
+	timeout->data = data;
+	timeout->next = timeouts;
+	timeouts = timeout;
+	return timeout;
+}
+
+static void timeout_unlink(struct fpi_timeout *timeout)
+{
+	struct fpi_timeout **t;
+
+	for (t = &timeouts; *t != NULL; t = &(*t)->next) {
+		if (*t == timeout) {
+			*t = timeout->next;
+			return;
+		}
+	}
+}
+
+void fpi_timeout_cancel(struct fpi_timeout *timeout)
+{
+	timeout_unlink(timeout);
+	free(timeout);
+}
+
+/* Time before the expiry of the timeout in us (0 if expired) */
+static long timeout_remaining(struct fpi_timeout *timeout)
+{
+	struct timespec now;
+	long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (timeout->expiry.tv_sec - now.tv_sec) * 1000000
+	   + (timeout->expiry.tv_nsec - now.tv_nsec) / 1000;
+	return us > 0 ? us : 0;
+}
+
+/* Handle the events of the transport and expired timeouts (as
+ * fp_handle_events) */
+int fake_handle_events(void)
+{
+	struct fpi_timeout *timeout;
+	long us, next = 1000000;
+	int ret;
+
+	for (timeout = timeouts; timeout != NULL; timeout = timeout->next) {
+		us = timeout_remaining(timeout);
+		if (us < next)
+			next = us;
+	}
+	ret = dev_transport_poll(next);
+	if (ret != LIBUSB_SUCCESS)
+		return ret;
+
+	/* Callbacks may add or cancel timeouts, so search again after each
+	 * one. */
+	do {
+		for (timeout = timeouts; timeout != NULL; timeout = timeout->next) {
+			if (timeout_remaining(timeout) == 0)
+				break;
+		}
+		if (timeout != NULL) {
+			timeout_unlink(timeout);
+			timeout->callback(timeout->data);
+			free(timeout);
+		}
+	} while (timeout != NULL);
+	return 0;
+}
+
 /* external interface for testing */
-struct fp_img_dev *global_init(void)
+
+/* Open the device without initializing it (see global_init) */
+struct fp_img_dev *global_open(void)
 {
 	int ret;
 	struct fp_img_dev *dev;
@@ -93,43 +201,94 @@ struct fp_img_dev *global_init(void)
 	ret = libusb_init(&fpi_usb_ctx);
 	if (ret != LIBUSB_SUCCESS) {
 		fp_err("libusb_init failed %d", ret);
-		goto cantclaim;
+		return NULL;
 	}
 
 	dev = malloc(sizeof(struct fp_img_dev));
 	if (dev == NULL) {
 		fp_err("cannot allocate memory");
-		goto cantclaim;
+		goto err_exit;
 	}
+	memset(dev, 0, sizeof(*dev));
 
 	dev->udev = libusb_open_device_with_vid_pid(fpi_usb_ctx, 0x1c7a, 0x0603);
-	if (dev->udev == NULL) {
+	/* A replayed trace (ETES603_REPLAY) or the emulator (ETES603_EMULATE)
+	 * do not need the sensor. */
+	if (dev->udev == NULL && !dev_transport_local()) {
 		fp_err("libusb_open_device_with_vid_pid failed");
 		free(dev);
-		dev = NULL;
-		goto cantclaim;
+		goto err_exit;
 	}
-
-	if (dev_init(dev, 0x0603))
-		dev = NULL;
-
-cantclaim:
 	return dev;
+
+err_exit:
+	libusb_exit(fpi_usb_ctx);
+	return NULL;
 }
 
-void global_exit(struct fp_img_dev * dev)
+void global_close(struct fp_img_dev * dev)
 {
-	dev_deinit(dev);
-
 	if (dev->udev) {
 		libusb_close(dev->udev);
 		dev->udev = NULL;
 	}
+	free(dev);
 
 	/* TODO how to test fpi_usb_ctx */
 	libusb_exit(fpi_usb_ctx);
 }
 
+struct fp_img_dev *global_init(void)
+{
+	int ret;
+	struct fp_img_dev *dev;
+
+	if ((dev = global_open()) == NULL)
+		return NULL;
+
+	open_status = 1;
+	if (dev_init(dev, 0x0603)) {
+		global_close(dev);
+		return NULL;
+	}
+	/* The sensor is opened asynchronously. */
+	while (open_status == 1) {
+		ret = fake_handle_events();
+		if (ret != LIBUSB_SUCCESS) {
+			fp_err("fake_handle_events failed %d", ret);
+			break;
+		}
+	}
+	if (open_status != 0) {
+		global_close(dev);
+		return NULL;
+	}
+	return dev;
+}
+
+/* Deactivate the device as libfprint does after an image or an error, and
+ * wait for the end of the deactivation */
+int global_deactivate(struct fp_img_dev *dev)
+{
+	int ret;
+
+	dev_deactivate(dev);
+	while (active) {
+		ret = fake_handle_events();
+		if (ret != LIBUSB_SUCCESS) {
+			fp_err("fake_handle_events failed %d", ret);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+void global_exit(struct fp_img_dev * dev)
+{
+	dev_deinit(dev);
+	global_close(dev);
+}
+
 #if 0
 int main()
 {
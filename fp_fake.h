@@ -58,6 +58,12 @@ struct fp_img {
 	unsigned char data[0];
 };
 typedef int gboolean;
+
+struct fpi_timeout;
+typedef void (*fpi_timeout_fn)(void *data);
+struct fpi_timeout *fpi_timeout_add(unsigned int msec, fpi_timeout_fn callback,
+	void *data);
+void fpi_timeout_cancel(struct fpi_timeout *timeout);
 struct etes603_dev;
 
 int frame_capture(struct etes603_dev *dev, uint8_t *buf);
@@ -66,19 +72,60 @@ int frame_prepare_capture(struct etes603_dev *dev);
 int fp_capture_asm(struct etes603_dev *dev, uint8_t *braw, int size);
 int fp_capture(struct etes603_dev *dev, uint8_t *buf, size_t size);
 
+/* Need to be in sync with etes603.c */
+struct frame_desc {
+	uint8_t *raw;
+	unsigned int brightness;
+	unsigned int hist[16];
+	unsigned int has_hist;
+};
+
 uint8_t *process_frame(uint8_t *dst, uint8_t *src);
+uint8_t *process_frame_predict(uint8_t *dst, const struct frame_desc *src,
+	int *new_line);
+void process_frame_describe(struct frame_desc *fd, uint8_t *raw);
 int process_frame_empty(uint8_t *f, size_t s, int mode);
+int process_frame_desc_empty(const struct frame_desc *fd, int mode);
+void process_transform4_to_32(uint8_t *input, unsigned int input_size,
+	uint32_t *output, int low_first);
 int contact_detect(struct etes603_dev *dev);
 
-int dev_set_regs(void *dev, int n_args, ... /*int reg, int val*/);
-int dev_get_regs(void *dev, int n_args, ... /* int reg, int *val */);
+int dev_set_regs(struct etes603_dev *dev, int n_args, ... /*int reg, int val*/);
+int dev_get_regs(struct etes603_dev *dev, int n_args, ... /* int reg, uint8_t *val */);
+/* Same without shadow registers (the sensor does not need to be opened) */
+int sync_set_regs(struct libusb_device_handle *udev, int n_args, ... /*int reg, int val*/);
+int sync_get_regs(struct libusb_device_handle *udev, int n_args, ... /* int reg, uint8_t *val */);
+int sync_cmd60(struct libusb_device_handle *udev, uint8_t cmd, uint8_t val, uint8_t *reg);
+
+/* Transport of the transfers */
+int dev_transport_poll(long us);
+int dev_transport_local(void);
+
+/* Lines of the assembled image while it is captured. With ETES603_WORKER=1,
+ * the callback runs in the assembly worker thread except for the end of the
+ * image (n == 0), whose status is 0 if the image is complete, -ECANCELED if
+ * the device was deactivated, else the error of the session (see
+ * dev_set_rows_cb). */
+typedef void (*dev_rows_fn)(void *data, const uint8_t *rows, unsigned int n,
+	int status);
+void dev_set_rows_cb(struct etes603_dev *dev, dev_rows_fn cb, void *data);
+
+/* Statistics of the requests */
+void dev_dump_stats(struct etes603_dev *dev, FILE *f);
+void dev_reset_stats(struct etes603_dev *dev);
 
 int dev_init(struct fp_img_dev *idev, unsigned long driver_data);
 void dev_deinit(struct fp_img_dev *idev);
+int dev_activate(struct fp_img_dev *idev, int/*enum fp_imgdev_state*/ state);
+void dev_deactivate(struct fp_img_dev *idev);
 
 
 /* fp_fake.c */
+struct fp_img_dev *global_open(void);
+void global_close(struct fp_img_dev * dev);
 struct fp_img_dev *global_init(void);
 void global_exit(struct fp_img_dev * dev);
+int global_deactivate(struct fp_img_dev *dev);
+int fake_handle_events(void);
 
 
@@ -59,36 +59,17 @@ static volatile int stop = 0;
 #define FRAME_WIDTH 0xC0  /* 192 */
 
 
-/* Transform binary to image */
+/* Transform binary to image (lines of 192 pixels in lines of 256) */
 void transform(unsigned char *input, unsigned int input_size, uint32_t *output, size_t output_size)
 {
   unsigned int i, j = 0;
-  for (i = 0; i < input_size && j < output_size; i++, j += 2)
-    {
-      unsigned char dl = input[i] << 4;
-      unsigned char dh = input[i] & 0xF0;
-      output[j]   = dh | (dh << 8) | (dh << 16);
-      output[j+1] = dl | (dl << 8) | (dl << 16);
-      //if ((i != 0) && ((i % (FRAME_WIDTH/2)) == (FRAME_WIDTH/2)-1)) {
-      //  j += (256-FRAME_WIDTH);
-      if ((i != 0) && ((i % 96) == 95)) {
-        j += (256-192);
-      //if ((i != 0) && ((i % 48) == 47)) {
-      //  j += (256-96);
-      }
-    }
+  for (i = 0; i + 96 <= input_size && j + 192 <= output_size; i += 96, j += 256)
+    process_transform4_to_32(input + i, 96, output + j, 0);
 }
 
 void transform2(unsigned char *input, unsigned int input_size, uint32_t *output)
 {
-  unsigned int i, j = 0;
-  for (i = 0; i < input_size; i++, j += 2)
-    {
-      unsigned char dl = input[i] << 4;
-      unsigned char dh = input[i] & 0xF0;
-      output[j+1]   = dl | (dl << 8) | (dl << 16);
-      output[j] = dh | (dh << 8) | (dh << 16);
-    }
+  process_transform4_to_32(input, input_size, output, 0);
 }
 
 void modifyLive(Display *dis, Window win, GC gc)
@@ -144,16 +125,6 @@ void draw(Display *dis, Window win, GC gc)
   XFlush(dis);
 }
 
-static unsigned int liminosity(uint8_t *d, int size)
-{
-  int i;
-  unsigned int sum = 0;
-  for (i = 0; i < size; i++) {
-    sum += d[i];
-  }
-  return sum;
-}
-
 void *thread_entry(void *arg)
 {
   struct fp_img_dev *idev = (struct fp_img_dev *)arg;
@@ -162,6 +133,8 @@ void *thread_entry(void *arg)
   uint8_t *braw = malloc(256000);
   uint8_t *brawp = braw;
   uint8_t *bframe = malloc(256000);
+  struct frame_desc fd;
+  int new_line;
   uint8_t *bimg = malloc(image_width*image_height*4*2);
   XExposeEvent event = { Expose, 0, 1, dis, draw_win, 0, 0, image_width, image_height, 0 };
 
@@ -188,16 +161,19 @@ void *thread_entry(void *arg)
   while (stop == 0) {
 #ifdef MODE_FRAME
     frame_capture(dev, bframe);
-    if (process_frame_empty(bframe, FRAME_WIDTH * 2, 1))
+    process_frame_describe(&fd, bframe);
+    if (process_frame_desc_empty(&fd, 1))
       continue;
 
+    new_line = -1;
     do {
-      brawp = process_frame(brawp, bframe/*, FRAME_WIDTH*/);
+      brawp = process_frame_predict(brawp, &fd, &new_line);
       //memcpy(brawp, bframe, FRAME_WIDTH * 2);
       //brawp += 384 /*FRAME_WIDTH * 2*/;
       if (brawp + 384 >= braw + 256000)
         break;
       frame_capture(dev, bframe);
+      process_frame_describe(&fd, bframe);
       /* Realtime... */
       transform(braw, 96000, (uint32_t *)bimg, image_width * image_height);
       if (image != NULL) {
@@ -208,7 +184,7 @@ void *thread_entry(void *arg)
 
       if (stop)
         goto leave_loop;
-    } while (!process_frame_empty(bframe, FRAME_WIDTH * 2, 1));
+    } while (!process_frame_desc_empty(&fd, 1));
     transform(braw, 96000, (uint32_t *)bimg, image_width * image_height);
 #endif
 
@@ -226,14 +202,10 @@ void *thread_entry(void *arg)
       continue;
 
     //fp_capture(dev, bframe);
-    if (fp_capture(dev, bframe, 64000))
-    //if (sync_read_buffer_full(udev, bframe))
+    if (fp_capture(dev, braw, 64000))
       stop = 1;
-    memcpy(braw, bframe, 64000);
-    if (fp_capture(dev, bframe, 64000))
-    //if (sync_read_buffer_full(udev, bframe))
+    if (fp_capture(dev, braw + 64000, 64000))
       stop = 1;
-    memcpy(braw+64000, bframe, 64000);
     memset(bimg, 0, 64000*2*4);
     transform2(braw, 128000, (uint32_t *)bimg);
     frame_prepare_capture(dev);
@@ -243,21 +215,24 @@ void *thread_entry(void *arg)
     static int index = 0;
     char filename[255];
     frame_capture(dev, bframe);
-    if (process_frame_empty(bframe, FRAME_WIDTH * 2, 1))
+    process_frame_describe(&fd, bframe);
+    if (process_frame_desc_empty(&fd, 1))
       continue;
     sprintf (filename, "/tmp/scan%03d", index++);
     FILE *f = fopen(filename, "w");
     if (!f) perror("fopen");
+    new_line = -1;
     do {
-      brawp = process_frame(brawp, bframe);
+      brawp = process_frame_predict(brawp, &fd, &new_line);
       frame_capture(dev, bframe);
+      process_frame_describe(&fd, bframe);
       /* writing file */
       if (f)
         fwrite (bframe, 1, 384, f);
 
       if (stop)
         goto leave_loop;
-    } while (!process_frame_empty(bframe, FRAME_WIDTH * 2, 1));    /* Saving all frames to files */
+    } while (!process_frame_desc_empty(&fd, 1));    /* Saving all frames to files */
     transform(braw, 96000, (uint32_t *)bimg, image_width * image_height);
     if (f) {
       fclose(f);
@@ -282,6 +257,80 @@ void *thread_entry(void *arg)
   return NULL;
 }
 
+/* Live view of the assembled frames mode (ETES603_MODE=1): the driver
+ * captures asynchronously and gives the lines as soon as they are assembled
+ * (see dev_set_rows_cb). */
+struct stream {
+  unsigned int lines;  /* Lines of the current image shown */
+  int end;             /* End of the image given */
+  int status;          /* Status of the end of the image */
+};
+
+void stream_redraw(void)
+{
+  XExposeEvent event = { Expose, 0, 1, dis, draw_win, 0, 0, image_width, image_height, 0 };
+
+  XSendEvent(dis, draw_win, False, 0, (XEvent *)&event);
+  XFlush(dis);
+}
+
+/* Called by the driver, in the assembly worker with ETES603_WORKER=1 */
+void stream_rows(void *data, const uint8_t *rows, unsigned int n, int status)
+{
+  struct stream *s = data;
+  uint32_t *out;
+
+  if (n == 0) {
+    s->end = 1;
+    s->status = status;
+    return;
+  }
+  if (image == NULL || s->lines >= (unsigned int)image_height)
+    return;
+  /* New image */
+  if (s->lines == 0)
+    memset(image->data, 0xFF, image_width * image_height * 4);
+  out = (uint32_t *)image->data + s->lines * image_width;
+  transform((unsigned char *)rows, n * FRAME_WIDTH / 2, out,
+            (image_height - s->lines) * image_width);
+  s->lines += n;
+  stream_redraw();
+}
+
+void *stream_entry(void *arg)
+{
+  struct fp_img_dev *idev = (struct fp_img_dev *)arg;
+  struct stream s;
+  int ret;
+
+  printf("Live view thread started...\n");
+  dev_set_rows_cb(idev->priv, stream_rows, &s);
+  while (stop == 0) {
+    memset(&s, 0, sizeof(s));
+    if (dev_activate(idev, 0)) {
+      printf("dev_activate failed\n");
+      break;
+    }
+    while (stop == 0 && s.end == 0) {
+      ret = fake_handle_events();
+      if (ret) {
+        printf("fake_handle_events failed %d\n", ret);
+        stop = 1;
+      }
+    }
+    if (s.end && s.status)
+      printf("Swipe aborted (%d) after %u lines\n", s.status, s.lines);
+    else if (s.end)
+      printf("Swipe of %u lines\n", s.lines);
+    /* As libfprint after the image */
+    if (global_deactivate(idev))
+      break;
+  }
+  dev_set_rows_cb(idev->priv, NULL, NULL);
+  printf("Live view thread leaving...\n");
+  return NULL;
+}
+
 void MakeButton(int x, int y, char * label,int (*fun)(struct fp_img_dev *), int id)
 {
    Cursor tempcursor;
@@ -391,14 +440,14 @@ int AddReg(struct fp_img_dev *dev, uint8_t reg, int add, char *name, uint8_t min
   uint8_t oldv, newv;
   if (!dev)
     return 1;
-  dev_get_regs(dev->udev, 2, reg, &oldv);
+  dev_get_regs(dev->priv, 2, reg, &oldv);
   newv = oldv + add;
   if (newv < min)
     newv = min;
   if (newv > max)
     newv = max;
   printf("%s (%02X) = %02X -> %02X\n", name, reg, oldv, newv);
-  dev_set_regs(dev->udev, 2, reg, newv);
+  dev_set_regs(dev->priv, 2, reg, newv);
   return 0;
 }
 
@@ -406,7 +455,7 @@ int IncReg03(struct fp_img_dev *dev)
 {
   /* TODO unknown min max */
   //return AddReg(dev, 0x03, 1, "REG_03", 0, 0x35);
-  dev_set_regs(dev->udev, 2, 0x03, 0x08);
+  dev_set_regs(dev->priv, 2, 0x03, 0x08);
   return 0;
 }
 
@@ -535,6 +584,24 @@ int DecDCOffset(struct fp_img_dev *dev)
   return AddReg(dev, 0xE6, -1, "DCOFFSET", 0, 0x35);
 }
 
+/* Statistics of the requests since the sensor was opened or reset */
+int DumpStats(struct fp_img_dev *dev)
+{
+  if (!dev)
+    return 1;
+  dev_dump_stats(dev->priv, stdout);
+  return 0;
+}
+
+int ResetStats(struct fp_img_dev *dev)
+{
+  if (!dev)
+    return 1;
+  dev_reset_stats(dev->priv);
+  printf("Statistics reset\n");
+  return 0;
+}
+
 
 
 int main(int argc, char *argv[])
@@ -544,6 +611,7 @@ int main(int argc, char *argv[])
   int i;
   XEvent event;
   struct fp_img_dev *dev;
+  char *live;
 
   if (argc >= 2) {
     strFilename = argv[1];
@@ -650,6 +718,9 @@ int main(int argc, char *argv[])
   y += 20; id += 2;
   MakeButton(300, y, "IncDCOff", IncDCOffset, id);
   MakeButton(400, y, "DecDCOff", DecDCOffset, id+1);
+  y += 20; id += 2;
+  MakeButton(300, y, "Stats", DumpStats, id);
+  MakeButton(400, y, "RstStats", ResetStats, id+1);
 
   // XSelectInput (dis, mainwin, ExposureMask | KeyPressMask | ButtonPressMask);
   XMapWindow(dis, mainwin);
@@ -660,12 +731,15 @@ int main(int argc, char *argv[])
 
   dev = global_init();
 
-  if (dev == NULL || dev->udev == NULL) {
+  if (dev == NULL) {
     fprintf(stderr, "Cannot open device\n");
   }
 
-  /* create thread */
-  if (dev != NULL && dev->udev != NULL)
+  /* create thread, the live view needs the assembled frames mode */
+  live = getenv("ETES603_MODE");
+  if (dev != NULL && live != NULL && live[0] == '1')
+    pthread_create(&thread, NULL, stream_entry, (void*)dev);
+  else if (dev != NULL)
     pthread_create(&thread, NULL, thread_entry, (void*)dev);
 
   while (1)
@@ -711,14 +785,14 @@ int main(int argc, char *argv[])
 #define REG_TUNE 0xE6
             if (XK_o == XLookupKeysym (&event.xkey, 0)) {
                 unsigned char reg = 0;
-                dev_get_regs(dev->udev, 2, REG_TUNE, &reg);
-                dev_set_regs(dev->udev, 2, REG_TUNE, ++reg);
+                dev_get_regs(dev->priv, 2, REG_TUNE, &reg);
+                dev_set_regs(dev->priv, 2, REG_TUNE, ++reg);
                 printf("%02x: %02x\n", REG_TUNE, reg);
             }
             if (XK_l == XLookupKeysym (&event.xkey, 0)) {
                 int reg;
-                dev_get_regs(dev->udev, 2, REG_TUNE, &reg);
-                dev_set_regs(dev->udev, 2, REG_TUNE, --reg);
+                dev_get_regs(dev->priv, 2, REG_TUNE, &reg);
+                dev_set_regs(dev->priv, 2, REG_TUNE, --reg);
                 printf("%02x: %02x\n", REG_TUNE, reg);
             }
             if (XK_q == XLookupKeysym (&event.xkey, 0))
@@ -734,7 +808,7 @@ int main(int argc, char *argv[])
 finishing:
   stop = 1;
   usleep(500*1000);
-  if (dev != NULL && dev->udev != NULL)
+  if (dev != NULL)
     global_exit(dev);
 
   /* For some reason the event loop stopped before q was pressed. */